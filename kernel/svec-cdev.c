@@ -0,0 +1,422 @@
+/*
+* Copyright (C) 2014 CERN (www.cern.ch)
+*
+* Released according to the GNU GPL, version 2 or any later version
+*
+* Driver for SVEC (Simple VME FMC carrier) board.
+* Per-card character device: userspace interrupt delivery.
+*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/interrupt.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+
+#include "svec.h"
+#include "svec-user.h"
+
+/* VM_RESERVED did its job before 3.7 */
+#ifndef VM_DONTDUMP
+#define VM_DONTDUMP VM_RESERVED
+#endif
+
+/* One open file of /dev/svec.<lun>, bound to at most one VIC vector */
+struct svec_irq_file {
+	struct svec_dev *svec;	/* NULL once the card is gone */
+	struct list_head list;
+	int irq;		/* Linux IRQ of the vector, 0 if none */
+	unsigned long masked;	/* bit 0: disabled by the handler, waiting for ack */
+	atomic_t events;
+	u32 last;		/* event count returned by the last read */
+	wait_queue_head_t wait;
+	struct eventfd_ctx *efd;
+	struct address_space *mapping;	/* to revoke the mmap()s of the file */
+};
+
+/* Protects the file lists and the file->card links, cards come and go */
+static DEFINE_MUTEX(svec_cdev_lock);
+
+static irqreturn_t svec_cdev_irq_handler(int irq, void *dev_id)
+{
+	struct svec_irq_file *f = dev_id;
+
+	/* keep the source quiet until userspace has serviced it */
+	disable_irq_nosync(irq);
+	set_bit(0, &f->masked);
+
+	atomic_inc(&f->events);
+	wake_up_interruptible(&f->wait);
+	if (f->efd)
+		eventfd_signal(f->efd, 1);
+
+	return IRQ_HANDLED;
+}
+
+/* what the handler returns goes to the storm detector of the VIC */
+static irqreturn_t svec_cdev_irq_wrapper(int irq, void *dev_id)
+{
+	struct svec_irq_file *f = dev_id;
+	irqreturn_t rv;
+
+	rv = svec_cdev_irq_handler(irq, dev_id);
+	svec_vic_irq_note(f->svec, irq, rv);
+	return rv;
+}
+
+/* called with svec_cdev_lock held */
+static void svec_cdev_irq_release(struct svec_irq_file *f)
+{
+	if (f->irq) {
+		free_irq(f->irq, f);
+		f->irq = 0;
+		svec_irq_put_card_mapping(f->svec);
+	}
+	clear_bit(0, &f->masked);
+	if (f->efd) {
+		eventfd_ctx_put(f->efd);
+		f->efd = NULL;
+	}
+}
+
+/* called with svec_cdev_lock held, @req already copied from userspace */
+static int svec_cdev_irq_request(struct svec_irq_file *f,
+				 struct svec_irq_request *req)
+{
+	struct svec_dev *svec = f->svec;
+	int irq, rv;
+
+	if (f->irq)
+		return -EBUSY;
+
+	irq = svec_irq_find_card_mapping(svec, req->id);
+	if (irq < 0)
+		return irq;
+
+	if (req->eventfd >= 0) {
+		f->efd = eventfd_ctx_fdget(req->eventfd);
+		if (IS_ERR(f->efd)) {
+			rv = PTR_ERR(f->efd);
+			f->efd = NULL;
+			goto out_put;
+		}
+	}
+
+	rv = request_irq(irq, svec_cdev_irq_wrapper, 0, svec->name, f);
+	if (rv) {
+		svec_cdev_irq_release(f);
+		goto out_put;
+	}
+
+	f->irq = irq;
+	return 0;
+
+      out_put:
+	/* the card's VME vector may have been claimed for this request */
+	svec_irq_put_card_mapping(svec);
+	return rv;
+}
+
+/* re-enables a vector masked by the handler; the EOI was already issued by
+   the dispatcher, right after the handler ran */
+static int svec_cdev_irq_ack(struct svec_irq_file *f)
+{
+	if (!f->irq)
+		return -EINVAL;
+
+	if (test_and_clear_bit(0, &f->masked))
+		enable_irq(f->irq);
+	return 0;
+}
+
+/* the vector of the file, 0 if none (or released with the card's) */
+static int svec_cdev_irq(struct svec_irq_file *f)
+{
+	int irq;
+
+	mutex_lock(&svec_cdev_lock);
+	irq = f->irq;
+	mutex_unlock(&svec_cdev_lock);
+	return irq;
+}
+
+static int svec_cdev_open(struct inode *inode, struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+	struct svec_dev *svec = container_of(misc, struct svec_dev, misc);
+	struct svec_irq_file *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+
+	init_waitqueue_head(&f->wait);
+	atomic_set(&f->events, 0);
+
+	mutex_lock(&svec_cdev_lock);
+	f->svec = svec;
+	f->mapping = file->f_mapping;
+	list_add(&f->list, &svec->irq_files);
+	mutex_unlock(&svec_cdev_lock);
+
+	file->private_data = f;
+	return 0;
+}
+
+static int svec_cdev_release(struct inode *inode, struct file *file)
+{
+	struct svec_irq_file *f = file->private_data;
+
+	mutex_lock(&svec_cdev_lock);
+	if (f->svec) {
+		svec_cdev_irq_release(f);
+		list_del(&f->list);
+	}
+	mutex_unlock(&svec_cdev_lock);
+
+	kfree(f);
+	return 0;
+}
+
+static long svec_cdev_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct svec_irq_file *f = file->private_data;
+	struct svec_irq_request req;
+	long rv;
+
+	/* before the lock: mmap() takes it with mmap_sem held, and a fault
+	   here takes mmap_sem */
+	if (cmd == SVEC_IOCTL_IRQ_REQUEST &&
+	    copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&svec_cdev_lock);
+	if (!f->svec) {
+		rv = -ENODEV;
+		goto out;
+	}
+
+	switch (cmd) {
+	case SVEC_IOCTL_IRQ_REQUEST:
+		rv = svec_cdev_irq_request(f, &req);
+		break;
+	case SVEC_IOCTL_IRQ_ACK:
+		rv = svec_cdev_irq_ack(f);
+		break;
+	default:
+		rv = -ENOTTY;
+	}
+      out:
+	mutex_unlock(&svec_cdev_lock);
+	return rv;
+}
+
+static ssize_t svec_cdev_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct svec_irq_file *f = file->private_data;
+	u32 events;
+	int rv;
+
+	if (count != sizeof(events))
+		return -EINVAL;
+	if (!svec_cdev_irq(f))
+		return -ENODEV;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (atomic_read(&f->events) == f->last)
+			return -EAGAIN;
+	} else {
+		/* svec_cdev_irq_exit() wakes us up after releasing the vector */
+		rv = wait_event_interruptible(f->wait,
+					      atomic_read(&f->events) != f->last
+					      || !ACCESS_ONCE(f->irq));
+		if (rv)
+			return rv;
+	}
+
+	if (!svec_cdev_irq(f))
+		return -ENODEV;
+
+	events = atomic_read(&f->events);
+	if (copy_to_user(buf, &events, sizeof(events)))
+		return -EFAULT;
+
+	f->last = events;
+	return sizeof(events);
+}
+
+static ssize_t svec_cdev_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct svec_irq_file *f = file->private_data;
+	u32 val;
+	int rv = 0;
+
+	if (count != sizeof(val))
+		return -EINVAL;
+	if (copy_from_user(&val, buf, sizeof(val)))
+		return -EFAULT;
+
+	mutex_lock(&svec_cdev_lock);
+	if (!f->svec)
+		rv = -ENODEV;
+	else if (val == 1)
+		rv = svec_cdev_irq_ack(f);
+	mutex_unlock(&svec_cdev_lock);
+
+	return rv ? rv : count;
+}
+
+static unsigned int svec_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct svec_irq_file *f = file->private_data;
+
+	if (!svec_cdev_irq(f))
+		return POLLERR;
+
+	poll_wait(file, &f->wait, wait);
+
+	if (atomic_read(&f->events) != f->last)
+		return POLLIN | POLLRDNORM;
+	if (!svec_cdev_irq(f))
+		return POLLERR;
+	return 0;
+}
+
+/* the window was revoked (the card was reconfigured or removed) */
+static int svec_cdev_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct svec_cdev_vm_ops = {
+	.fault = svec_cdev_vm_fault,
+};
+
+/*
+ * Maps (part of) the register window, the file offset being the offset in
+ * the window, for tools which move blocks of data, like firmware loaders.
+ * The mappings are torn down when the window is unmapped.
+ */
+static int svec_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct svec_irq_file *f = file->private_data;
+	struct vme_mapping *map;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	u64 phys;
+	int rv;
+
+	mutex_lock(&svec_cdev_lock);
+	map = f->svec ? f->svec->mmap_win : NULL;
+	if (!map) {
+		rv = -ENODEV;
+		goto out;
+	}
+
+	/* a private copy of registers makes no sense, and could not be revoked */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		rv = -EINVAL;
+		goto out;
+	}
+
+	phys = ((u64)map->pci_addru << 32) | map->pci_addrl;
+	if ((phys & ~PAGE_MASK) || off >= map->sizel ||
+	    size > map->sizel - off) {
+		rv = -EINVAL;
+		goto out;
+	}
+
+	vma->vm_ops = &svec_cdev_vm_ops;
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	rv = io_remap_pfn_range(vma, vma->vm_start, (phys + off) >> PAGE_SHIFT,
+				size, vma->vm_page_prot);
+      out:
+	mutex_unlock(&svec_cdev_lock);
+	return rv;
+}
+
+static const struct file_operations svec_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = svec_cdev_open,
+	.release = svec_cdev_release,
+	.unlocked_ioctl = svec_cdev_ioctl,
+	.read = svec_cdev_read,
+	.write = svec_cdev_write,
+	.poll = svec_cdev_poll,
+	.mmap = svec_cdev_mmap,
+	.llseek = no_llseek,
+};
+
+/* Frees the vectors held by userspace, before the VIC goes away */
+void svec_cdev_irq_exit(struct svec_dev *svec)
+{
+	struct svec_irq_file *f;
+
+	mutex_lock(&svec_cdev_lock);
+	list_for_each_entry(f, &svec->irq_files, list) {
+		svec_cdev_irq_release(f);
+		wake_up_interruptible(&f->wait);
+	}
+	mutex_unlock(&svec_cdev_lock);
+}
+
+/* called with svec_cdev_lock held */
+static void svec_cdev_revoke(struct svec_dev *svec)
+{
+	struct svec_irq_file *f;
+
+	svec->mmap_win = NULL;
+	list_for_each_entry(f, &svec->irq_files, list)
+		unmap_mapping_range(f->mapping, 0, 0, 1);
+}
+
+/* Sets the window mmap() gives access to; NULL revokes the existing mappings,
+   before the window goes away */
+void svec_cdev_set_window(struct svec_dev *svec, struct vme_mapping *map)
+{
+	mutex_lock(&svec_cdev_lock);
+	if (map)
+		svec->mmap_win = map;
+	else
+		svec_cdev_revoke(svec);
+	mutex_unlock(&svec_cdev_lock);
+}
+
+int svec_cdev_init(struct svec_dev *svec)
+{
+	INIT_LIST_HEAD(&svec->irq_files);
+
+	svec->misc.minor = MISC_DYNAMIC_MINOR;
+	svec->misc.name = svec->name;
+	svec->misc.fops = &svec_cdev_fops;
+	svec->misc.parent = svec->dev;
+
+	return misc_register(&svec->misc);
+}
+
+void svec_cdev_exit(struct svec_dev *svec)
+{
+	struct svec_irq_file *f, *tmp;
+
+	misc_deregister(&svec->misc);
+
+	/* files still open outlive the card: detach them */
+	mutex_lock(&svec_cdev_lock);
+	svec_cdev_revoke(svec);
+	list_for_each_entry_safe(f, tmp, &svec->irq_files, list) {
+		svec_cdev_irq_release(f);
+		f->svec = NULL;
+		list_del(&f->list);
+		wake_up_interruptible(&f->wait);
+	}
+	mutex_unlock(&svec_cdev_lock);
+}
@@ -0,0 +1,157 @@
+/*
+* Copyright (C) 2014 CERN (www.cern.ch)
+*
+* Released according to the GNU GPL, version 2 or any later version
+*
+* Driver for SVEC (Simple VME FMC carrier) board.
+* Interrupt statistics, exported through debugfs.
+*/
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+
+#include "svec.h"
+
+static void svec_dbg_show_hist(struct seq_file *m, struct svec_dev *svec,
+			       const char *name, size_t offset)
+{
+	int cpu, i;
+
+	seq_printf(m, "%s histogram (ns):\n%10s", name, "from");
+	for_each_online_cpu(cpu)
+		seq_printf(m, "  cpu%-7d", cpu);
+	seq_printf(m, "\n");
+
+	for (i = 0; i < SVEC_IRQ_HIST_BUCKETS; i++) {
+		seq_printf(m, "%10lu", i ? 1UL << (i + 6) : 0);
+		for_each_online_cpu(cpu) {
+			struct svec_irq_cpu_stats *stats =
+			    per_cpu_ptr(svec->irq_stats.cpu, cpu);
+			unsigned long *hist = (void *)stats + offset;
+
+			seq_printf(m, "  %-10lu", hist[i]);
+		}
+		seq_printf(m, "\n");
+	}
+}
+
+static int svec_dbg_stats_show(struct seq_file *m, void *unused)
+{
+	struct svec_dev *svec = m->private;
+	int i;
+
+	seq_printf(m, "interrupts: %lu\n", svec_irq_count(svec));
+	seq_printf(m, "spurious: %lu\n", svec->irq_stats.spurious);
+
+	for (i = 0; i < SVEC_N_SLOTS; i++)
+		seq_printf(m, "shared slot %d: invoked %lu handled %lu skipped %lu\n",
+			   i, svec->irq_stats.shared_calls[i],
+			   svec->irq_stats.shared_calls[i] -
+			   svec->irq_stats.shared_unhandled[i],
+			   svec->irq_stats.shared_skipped[i]);
+	seq_printf(m, "shared re-checks: %lu\n", svec->irq_stats.shared_rechecks);
+
+	svec_irq_show_vector(svec, m);
+
+	for (i = 0; i < SVEC_N_SLOTS; i++)
+		if (svec->slot_irq[i].vector >= 0)
+			seq_printf(m, "slot %d vector 0x%02x: %lu\n", i,
+				   svec->slot_irq[i].vector,
+				   svec->slot_irq[i].count);
+
+	svec_vic_show_stats(svec, m);
+
+	svec_dbg_show_hist(m, svec, "handler duration",
+			   offsetof(struct svec_irq_cpu_stats, handler_ns));
+	svec_dbg_show_hist(m, svec, "entry to EOI",
+			   offsetof(struct svec_irq_cpu_stats, eoi_ns));
+	svec_dbg_show_hist(m, svec, "timestamp to dispatch",
+			   offsetof(struct svec_irq_cpu_stats, dispatch_ns));
+	svec_dbg_show_hist(m, svec, "busy-poll detection gap",
+			   offsetof(struct svec_irq_cpu_stats, busy_gap_ns));
+	return 0;
+}
+
+static int svec_dbg_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, svec_dbg_stats_show, inode->i_private);
+}
+
+static const struct file_operations svec_dbg_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = svec_dbg_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Any write to irq_stats_reset clears all the counters of the card */
+static ssize_t svec_dbg_reset_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct svec_dev *svec = file->private_data;
+	unsigned long flags;
+	int cpu, i;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(svec->irq_stats.cpu, cpu), 0,
+		       sizeof(struct svec_irq_cpu_stats));
+	svec->irq_stats.spurious = 0;
+	memset(svec->irq_stats.shared_calls, 0,
+	       sizeof(svec->irq_stats.shared_calls));
+	memset(svec->irq_stats.shared_unhandled, 0,
+	       sizeof(svec->irq_stats.shared_unhandled));
+	memset(svec->irq_stats.shared_skipped, 0,
+	       sizeof(svec->irq_stats.shared_skipped));
+	svec->irq_stats.shared_rechecks = 0;
+	svec->irq_stats.demux_checks = 0;
+	svec->irq_stats.demux_hits = 0;
+	for (i = 0; i < SVEC_N_SLOTS; i++)
+		svec->slot_irq[i].count = 0;
+	svec_vic_reset_stats(svec);
+
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	return count;
+}
+
+static int svec_dbg_reset_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations svec_dbg_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = svec_dbg_reset_open,
+	.write = svec_dbg_reset_write,
+};
+
+/* Creates /sys/kernel/debug/svec.<lun>/, for the statistics allocated by probe */
+void svec_debugfs_init(struct svec_dev *svec)
+{
+	/* debugfs is optional: the statistics are collected anyway */
+	svec->dbg_dir = debugfs_create_dir(svec->name, NULL);
+	if (IS_ERR_OR_NULL(svec->dbg_dir)) {
+		svec->dbg_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("irq_stats", S_IRUGO, svec->dbg_dir, svec,
+			    &svec_dbg_stats_fops);
+	debugfs_create_file("irq_stats_reset", S_IWUSR, svec->dbg_dir, svec,
+			    &svec_dbg_reset_fops);
+}
+
+void svec_debugfs_exit(struct svec_dev *svec)
+{
+	debugfs_remove_recursive(svec->dbg_dir);
+	svec->dbg_dir = NULL;
+}
@@ -16,9 +16,13 @@
 #include <linux/firmware.h>
 #include <linux/delay.h>
 #include <linux/jhash.h>
+#include <linux/sched.h>
 #include "svec.h"
 #include "hw/xloader_regs.h"
 
+#define CREATE_TRACE_POINTS
+#include "svec-trace.h"
+
 char *svec_fw_name = "fmc/svec-golden.bin";
 
 /* Module parameters */
@@ -30,6 +34,10 @@ static char *fw_name[SVEC_MAX_DEVICES];
 static unsigned int fw_name_num;
 static int vector[SVEC_MAX_DEVICES] = SVEC_UNINITIALIZED_IRQ_VECTOR;
 static unsigned int vector_num;
+static int vector_fmc0[SVEC_MAX_DEVICES] = SVEC_UNINITIALIZED_IRQ_VECTOR;
+static unsigned int vector_fmc0_num;
+static int vector_fmc1[SVEC_MAX_DEVICES] = SVEC_UNINITIALIZED_IRQ_VECTOR;
+static unsigned int vector_fmc1_num;
 static int level[SVEC_MAX_DEVICES] = SVEC_DEFAULT_IRQ_LEVEL;
 static unsigned int level_num;
 static int lun[SVEC_MAX_DEVICES] = SVEC_DEFAULT_IDX;
@@ -54,6 +62,10 @@ module_param_array_named(fw_name, fw_name, charp, &fw_name_num, S_IRUGO);
 MODULE_PARM_DESC(fw_name, "Firmware file");
 module_param_array(vector, int, &vector_num, S_IRUGO);
 MODULE_PARM_DESC(vector, "IRQ vector");
+module_param_array(vector_fmc0, int, &vector_fmc0_num, S_IRUGO);
+MODULE_PARM_DESC(vector_fmc0, "IRQ vector dedicated to FMC slot 0 (-1: use vector)");
+module_param_array(vector_fmc1, int, &vector_fmc1_num, S_IRUGO);
+MODULE_PARM_DESC(vector_fmc1, "IRQ vector dedicated to FMC slot 1 (-1: use vector)");
 module_param_array(level, int, &level_num, S_IRUGO);
 MODULE_PARM_DESC(level, "IRQ level");
 module_param(verbose, int, S_IRUGO);
@@ -74,6 +86,7 @@ int svec_map_window(struct svec_dev *svec, enum svec_map_win map_type)
 	unsigned long base;
 	unsigned int size;
 	int rval;
+	u64 t = local_clock();
 
 	if (svec->map[map_type] != NULL) {
 		dev_err(dev, "Window %d already mapped\n", (int)map_type);
@@ -119,6 +132,11 @@ int svec_map_window(struct svec_dev *svec, enum svec_map_win map_type)
 		 map_type == MAP_REG ? "register" : "CR/CSR",
 		 svec->map[map_type]->kernel_va);
 
+	if (map_type == MAP_REG)
+		svec_cdev_set_window(svec, svec->map[map_type]);
+
+	if (svec_trace_enabled(svec_window_map))
+		trace_svec_window_map(svec, map_type, local_clock() - t);
 	return 0;
 }
 
@@ -126,10 +144,14 @@ int svec_map_window(struct svec_dev *svec, enum svec_map_win map_type)
 int svec_unmap_window(struct svec_dev *svec, enum svec_map_win map_type)
 {
 	struct device *dev = svec->dev;
+	u64 t = local_clock();
 
 	if (svec->map[map_type] == NULL)
 		return 0;
 
+	if (map_type == MAP_REG)
+		svec_cdev_set_window(svec, NULL);
+
 	if (vme_release_mapping(svec->map[map_type], 1)) {
 		dev_err(dev, "Unmap for window %d failed\n", (int)map_type);
 		return -EINVAL;
@@ -140,6 +162,8 @@ int svec_unmap_window(struct svec_dev *svec, enum svec_map_win map_type)
 	
 	kfree(svec->map[map_type]);
 	svec->map[map_type] = NULL;
+	if (svec_trace_enabled(svec_window_unmap))
+		trace_svec_window_unmap(svec, map_type, local_clock() - t);
 	return 0;
 }
 
@@ -258,7 +282,7 @@ int svec_load_fpga(struct svec_dev *svec, const void *blob, int size)
 	int xldr_fifo_r0;	/* Bitstream data input control register */
 	int xldr_fifo_r1;	/* Bitstream data input register */
 	int i;
-	u64 timeout;
+	u64 timeout, t;
 	int rv = 0;
 
 	clear_bit(SVEC_FLAG_AFPGA_PROGRAMMED, &svec->flags);
@@ -280,6 +304,9 @@ int svec_load_fpga(struct svec_dev *svec, const void *blob, int size)
 		dev_err(dev, "%s: data to be load is NULL\n", __func__);
 		return -EINVAL;
 	}
+
+	t = local_clock();
+	trace_svec_load_fpga_start(svec, size);
 	if (!svec->map[MAP_CR_CSR])
 		rv = svec_map_window(svec, MAP_CR_CSR);
 
@@ -321,6 +348,8 @@ int svec_load_fpga(struct svec_dev *svec, const void *blob, int size)
 			i += n;
 		}
 	}
+	if (svec_trace_enabled(svec_load_fpga_drained))
+		trace_svec_load_fpga_drained(svec, local_clock() - t);
 
 	/* Two seconds later */
 	timeout = get_jiffies_64() + 2 * HZ;
@@ -331,6 +360,9 @@ int svec_load_fpga(struct svec_dev *svec, const void *blob, int size)
 		msleep(1);
 	}
 
+	if (svec_trace_enabled(svec_load_fpga_done))
+		trace_svec_load_fpga_done(svec, local_clock() - t);
+
 	if (!(rval & XLDR_CSR_DONE)) {
 		dev_err(dev, "error: FPGA program timeout.\n");
 		return -EIO;
@@ -363,16 +395,27 @@ static int svec_remove(struct device *pdev, unsigned int ndev)
 {
 	struct svec_dev *svec = dev_get_drvdata(pdev);
 
+	/* the attributes go first: vic_retry_autotune re-queues the tuning,
+	   irq_busy_poll_cpu restarts the polling thread */
+	svec_remove_sysfs_files(svec);
+	cancel_delayed_work_sync(&svec->vic_tune_work);
+	svec_vic_busy_poll(svec, -1);
+
 	if (test_bit(SVEC_FLAG_FMCS_REGISTERED, &svec->flags)) {
 		svec_fmc_destroy(svec);
 		clear_bit(SVEC_FLAG_FMCS_REGISTERED, &svec->flags);
 	}
 
 	svec_irq_exit(svec);
+	svec_vic_free_cache(svec);
+	svec_i2c_free_cache(svec);
+	svec_fmc_free_sdb(svec);
+	svec_cdev_exit(svec);
 
 	svec_unmap_window(svec, MAP_CR_CSR);
 	svec_unmap_window(svec, MAP_REG);
-	svec_remove_sysfs_files(svec);
+	svec_debugfs_exit(svec);
+	free_percpu(svec->irq_stats.cpu);
 
 	if(svec->verbose)
 	    dev_info(pdev, "removed\n");
@@ -452,6 +495,7 @@ int svec_setup_csr(struct svec_dev *svec)
 	int func;
 	void *base;
 	u8 ader[2][4];		/* FUN0/1 ADER contents */
+	u64 t = local_clock();
 
 	/* don't try to set up CSRs of an empty AFPGA */
 	if (!test_bit(SVEC_FLAG_AFPGA_PROGRAMMED, &svec->flags))
@@ -531,6 +575,8 @@ int svec_setup_csr(struct svec_dev *svec)
 
 	/* unmap the CSR window after configuring the card, it's no longer necessary */
 	svec_unmap_window(svec, MAP_CR_CSR);
+	if (svec_trace_enabled(svec_csr_setup))
+		trace_svec_csr_setup(svec, local_clock() - t);
 	return rv;
 }
 
@@ -541,6 +587,7 @@ int svec_validate_configuration(struct device *pdev, struct svec_config *cfg)
 {
 	uint32_t addr_mask, start_masked, end_masked;
 	uint32_t max_size;
+	int i;
 
 	/* no base address assigned? silently return. */
 	if (cfg->vme_base == (uint32_t) - 1)
@@ -605,6 +652,25 @@ int svec_validate_configuration(struct device *pdev, struct svec_config *cfg)
 		return 0;
 	}
 
+	for (i = 0; i < SVEC_N_SLOTS; i++) {
+		if (cfg->slot_vector[i] > 0xff) {
+			dev_err(pdev,
+				"VME interrupt vector of FMC slot %d out of range (requested = 0x%x, allowed: 0x00 - 0xff)\n",
+				i, cfg->slot_vector[i]);
+			return 0;
+		}
+	}
+
+	/* each dedicated vector can only be registered once */
+	if (cfg->slot_vector[0] >= 0 &&
+	    cfg->slot_vector[0] != cfg->interrupt_vector &&
+	    cfg->slot_vector[0] == cfg->slot_vector[1]) {
+		dev_err(pdev,
+			"FMC slots can't share a dedicated interrupt vector (0x%x)\n",
+			cfg->slot_vector[0]);
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -635,12 +701,14 @@ static void svec_prepare_description(struct svec_dev *svec)
 int svec_reconfigure(struct svec_dev *svec)
 {
 	int error;
+	u64 t;
 
 	/* no valid VME configuration? Silently return (it has to be done at some point via sysfs) */
 	if (!svec->cfg_cur.configured)
 		return 0;
 
 	/* FMCs loaded: remove before reconfiguring VME */
+	t = local_clock();
 	if (test_bit(SVEC_FLAG_FMCS_REGISTERED, &svec->flags)) {
 		if(svec->verbose)
 		dev_info(svec->dev,
@@ -648,18 +716,31 @@ int svec_reconfigure(struct svec_dev *svec)
 		svec_fmc_destroy(svec);
 		clear_bit(SVEC_FLAG_FMCS_REGISTERED, &svec->flags);
 	}
+	if (svec_trace_enabled(svec_reconfigure_phase))
+		trace_svec_reconfigure_phase(svec, "fmc_destroy",
+					     local_clock() - t);
+
+	/* Release the interrupts (the VIC is still mapped), unmap, config the VME
+	   core and remap the new window. */
+	t = local_clock();
+	svec_irq_exit(svec);
 
-	/* Unmap, config the VME core and remap the new window. */
 	if (svec->map[MAP_REG])
 		svec_unmap_window(svec, MAP_REG);
+	if (svec_trace_enabled(svec_reconfigure_phase))
+		trace_svec_reconfigure_phase(svec, "teardown", local_clock() - t);
 
-	svec_irq_exit(svec);
-
+	t = local_clock();
 	error = svec_setup_csr(svec);
+	if (svec_trace_enabled(svec_reconfigure_phase))
+		trace_svec_reconfigure_phase(svec, "setup_csr", local_clock() - t);
 	if (error)
 		return error;
 
+	t = local_clock();
 	error = svec_map_window(svec, MAP_REG);
+	if (svec_trace_enabled(svec_reconfigure_phase))
+		trace_svec_reconfigure_phase(svec, "map", local_clock() - t);
 	if (error)
 		return error;
 
@@ -668,7 +749,11 @@ int svec_reconfigure(struct svec_dev *svec)
 
 	/* FMC initialization enabled? Start up the FMC drivers. */
 	if (svec->cfg_cur.use_fmc) {
+		t = local_clock();
 		error = svec_fmc_create(svec);
+		if (svec_trace_enabled(svec_reconfigure_phase))
+			trace_svec_reconfigure_phase(svec, "fmc_create",
+						     local_clock() - t);
 		if (error) {
 			dev_err(svec->dev, "error creating fmc devices\n");
 			goto failed_unmap;
@@ -704,7 +789,7 @@ static int svec_probe(struct device *pdev, unsigned int ndev)
 {
 	struct svec_dev *svec;
 	const char *name;
-	int error = 0;
+	int error = 0, i;
 
 	if (lun[ndev] < 0 || lun[ndev] >= SVEC_MAX_DEVICES) {
 		dev_err(pdev, "Card lun %d out of range [0..%d]\n",
@@ -724,6 +809,21 @@ static int svec_probe(struct device *pdev, unsigned int ndev)
 	svec->slot = slot[ndev];
 	svec->fmcs_n = SVEC_N_SLOTS;	/* FIXME: Two mezzanines */
 	svec->dev = pdev;
+	svec->irq_poll_period_us = SVEC_DEFAULT_IRQ_POLL_PERIOD_US;
+	svec->irq_storm_threshold = SVEC_DEFAULT_IRQ_STORM_THRESHOLD;
+	svec->vic_retry_len = SVEC_DEFAULT_VIC_RETRY_LEN;
+	svec->irq_busy_poll_cpu = -1;
+	svec->irq_busy_poll_idle_us = SVEC_DEFAULT_BUSY_POLL_IDLE_US;
+	INIT_DELAYED_WORK(&svec->vic_tune_work, svec_vic_tune_work);
+	spin_lock_init(&svec->irq_lock);
+	mutex_init(&svec->sdb_lock);
+	for (i = 0; i < SVEC_N_SLOTS; i++) {
+		svec->slot_irq[i].svec = svec;
+		svec->slot_irq[i].slot = i;
+		svec->slot_irq[i].vector = -1;
+		spin_lock_init(&svec->slot_irq[i].lock);
+		mutex_init(&svec->i2c[i].lock);
+	}
 
 	svec->cfg_cur.use_vic = 1;
 	svec->cfg_cur.use_fmc = 1;
@@ -732,6 +832,8 @@ static int svec_probe(struct device *pdev, unsigned int ndev)
 	svec->cfg_cur.vme_size = vme_size[ndev];
 	svec->cfg_cur.interrupt_vector = vector[ndev];
 	svec->cfg_cur.interrupt_level = level[ndev];
+	svec->cfg_cur.slot_vector[0] = vector_fmc0[ndev];
+	svec->cfg_cur.slot_vector[1] = vector_fmc1[ndev];
 	svec->cfg_cur.configured = 1;
 	svec->cfg_cur.configured =
 	    svec_validate_configuration(pdev, &svec->cfg_cur);
@@ -771,10 +873,26 @@ static int svec_probe(struct device *pdev, unsigned int ndev)
 
 	svec_prepare_description(svec);
 
+	/* the interrupt path and the attributes use them from now on */
+	svec->irq_stats.cpu = alloc_percpu(struct svec_irq_cpu_stats);
+	if (!svec->irq_stats.cpu) {
+		dev_err(pdev, "Error allocating interrupt statistics\n");
+		error = -ENOMEM;
+		goto failed;
+	}
+
 	error = svec_create_sysfs_files(svec);
 	if (error) {
 		dev_err(pdev, "Error creating sysfs files\n");
-		goto failed;
+		goto failed_stats;
+	}
+
+	svec_debugfs_init(svec);
+
+	error = svec_cdev_init(svec);
+	if (error) {
+		dev_err(pdev, "Error registering the %s device\n", svec->name);
+		goto failed_sysfs;
 	}
 
 	/* Map user address space & give control to the FMCs */
@@ -782,6 +900,14 @@ static int svec_probe(struct device *pdev, unsigned int ndev)
 
 	return 0;
 
+failed_sysfs:
+	/* as in svec_remove(): the attributes first */
+	svec_remove_sysfs_files(svec);
+	cancel_delayed_work_sync(&svec->vic_tune_work);
+	svec_vic_busy_poll(svec, -1);
+	svec_debugfs_exit(svec);
+failed_stats:
+	free_percpu(svec->irq_stats.cpu);
 failed:
 	kfree(svec);
 
@@ -838,6 +964,7 @@ static int __init svec_init(void)
 static void __exit svec_exit(void)
 {
 	vme_unregister_driver(&svec_driver);
+	svec_vic_exit();
 }
 
 module_init(svec_init);
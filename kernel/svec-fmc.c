@@ -33,6 +33,280 @@ static void svec_writel(struct fmc_device *fmc, uint32_t val, int offset)
 	iowrite32be(val, fmc->fpga_base + offset);
 }
 
+/*
+ * The SDB tree of the gateware is read once per bitstream (svec->fw_hash)
+ * and cached by the card across reconfigurations, until the gateware
+ * changes. Each fmc device gets a copy of its own in fmc->sdb, that the
+ * mezzanine driver may free with fmc_free_sdb_tree() like any other tree.
+ */
+static void svec_sdb_free_tree(struct sdb_array *arr)
+{
+	int i;
+
+	if (!arr)
+		return;
+	for (i = 0; i < arr->len; i++)
+		if (!IS_ERR_OR_NULL(arr->subtree[i]))
+			svec_sdb_free_tree(arr->subtree[i]);
+	kfree(arr->record);
+	kfree(arr->subtree);
+	kfree(arr);
+}
+
+static struct sdb_array *svec_sdb_copy_tree(struct sdb_array *arr,
+					    struct sdb_array *parent)
+{
+	struct sdb_array *copy;
+	int i;
+
+	copy = kmemdup(arr, sizeof(*arr), GFP_KERNEL);
+	if (!copy)
+		return NULL;
+	copy->parent = parent;
+	copy->record = kmemdup(arr->record, arr->len * sizeof(*arr->record),
+			       GFP_KERNEL);
+	copy->subtree = kcalloc(arr->len, sizeof(*arr->subtree), GFP_KERNEL);
+	if (!copy->record || !copy->subtree) {
+		kfree(copy->record);
+		kfree(copy->subtree);
+		kfree(copy);
+		return NULL;
+	}
+	/* error pointers mark the non-bridge records: keep them as they are */
+	for (i = 0; i < arr->len; i++)
+		copy->subtree[i] = IS_ERR_OR_NULL(arr->subtree[i]) ?
+			arr->subtree[i] : ERR_PTR(-ENOMEM);
+	for (i = 0; i < arr->len; i++) {
+		if (IS_ERR_OR_NULL(arr->subtree[i]))
+			continue;
+		copy->subtree[i] = svec_sdb_copy_tree(arr->subtree[i], copy);
+		if (!copy->subtree[i]) {
+			copy->subtree[i] = ERR_PTR(-ENOMEM);
+			svec_sdb_free_tree(copy);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+/* Drops the cached tree; called with sdb_lock held */
+static void svec_sdb_drop(struct svec_dev *svec)
+{
+	if (!svec->sdb)
+		return;
+	svec_sdb_free_tree(svec->sdb->tree);
+	kfree(svec->sdb);
+	svec->sdb = NULL;
+}
+
+static int svec_sdb_get(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_sdb *sdb;
+	int ret = 0;
+
+	mutex_lock(&svec->sdb_lock);
+	if (svec->sdb && (svec->sdb->fw_hash != svec->fw_hash ||
+			  svec->fw_hash == 0xffffffff))
+		svec_sdb_drop(svec);
+
+	if (!svec->sdb) {
+		sdb = kzalloc(sizeof(*sdb), GFP_KERNEL);
+		if (!sdb) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ret = fmc_scan_sdb_tree(fmc, 0x0);
+		if (ret < 0) {
+			kfree(sdb);
+			goto out;
+		}
+		/* the scanned tree becomes the cache, the device gets a copy */
+		sdb->tree = fmc->sdb;
+		sdb->fw_hash = svec->fw_hash;
+		svec->sdb = sdb;
+		fmc->sdb = NULL;
+	}
+
+	fmc->sdb = svec_sdb_copy_tree(svec->sdb->tree, NULL);
+	ret = fmc->sdb ? 0 : -ENOMEM;
+out:
+	mutex_unlock(&svec->sdb_lock);
+	return ret;
+}
+
+/* Drops the cached tree and blob, when the card goes away */
+void svec_fmc_free_sdb(struct svec_dev *svec)
+{
+	mutex_lock(&svec->sdb_lock);
+	svec_sdb_drop(svec);
+	kfree(svec->sdb_blob);
+	svec->sdb_blob = NULL;
+	svec->sdb_blob_len = 0;
+	mutex_unlock(&svec->sdb_lock);
+}
+
+/*
+ * The SDB records of whatever gateware the card runs, for userspace (the
+ * sdb and sdb_devices attributes): all the levels of the tree, depth first,
+ * as 64-byte big-endian records with the addresses of bridges and devices
+ * made absolute. The table is read from the card once per bitstream: the
+ * trees of the mezzanine drivers are theirs, and may go away any time.
+ */
+#define SVEC_SDB_MAX_LEVEL	8
+#define SVEC_SDB_MAX_RECORDS	1024
+
+static void svec_sdb_read_record(struct svec_dev *svec, unsigned long addr,
+				 union sdb_record *r)
+{
+	void __iomem *va = svec->map[MAP_REG]->kernel_va + addr;
+	__be32 *p = (void *)r;
+	int i;
+
+	for (i = 0; i < sizeof(*r) / 4; i++)
+		p[i] = cpu_to_be32(ioread32be(va + 4 * i));
+}
+
+static int svec_sdb_scan_blob(struct svec_dev *svec, unsigned long sdb_addr,
+			      unsigned long base, int level)
+{
+	union sdb_record *r;
+	struct sdb_component *c;
+	uint64_t first, child;
+	int i, n, ret;
+
+	if (level > SVEC_SDB_MAX_LEVEL ||
+	    sdb_addr + sizeof(*r) > svec->cfg_cur.vme_size)
+		return -EINVAL;
+	if (svec->sdb_blob_len >= SVEC_SDB_MAX_RECORDS * sizeof(*r))
+		return -E2BIG;
+
+	r = svec->sdb_blob + svec->sdb_blob_len;
+	svec_sdb_read_record(svec, sdb_addr, r);
+	if (be32_to_cpu(r->ichk.sdb_magic) != SDB_MAGIC)
+		return -ENODEV;
+	n = be16_to_cpu(r->ichk.sdb_records);
+
+	for (i = 0; i < n; i++) {
+		if (svec->sdb_blob_len >= SVEC_SDB_MAX_RECORDS * sizeof(*r))
+			return -E2BIG;
+		if (sdb_addr + (i + 1) * sizeof(*r) > svec->cfg_cur.vme_size)
+			return -EINVAL;
+
+		r = svec->sdb_blob + svec->sdb_blob_len;
+		if (i)
+			svec_sdb_read_record(svec, sdb_addr + i * sizeof(*r), r);
+		svec->sdb_blob_len += sizeof(*r);
+
+		if (r->empty.record_type != sdb_type_device &&
+		    r->empty.record_type != sdb_type_bridge)
+			continue;
+		c = &r->dev.sdb_component;
+		first = be64_to_cpu(c->addr_first);
+		c->addr_first = cpu_to_be64(base + first);
+		c->addr_last = cpu_to_be64(base + be64_to_cpu(c->addr_last));
+
+		if (r->empty.record_type != sdb_type_bridge)
+			continue;
+		child = be64_to_cpu(r->bridge.sdb_child);
+		ret = svec_sdb_scan_blob(svec, base + child, base + first,
+					 level + 1);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* called with sdb_lock held */
+static int svec_sdb_update_blob(struct svec_dev *svec)
+{
+	int ret;
+
+	/* even a cached blob describes nothing while the card is not set up */
+	if (!svec->map[MAP_REG] || !svec->cfg_cur.configured ||
+	    !test_bit(SVEC_FLAG_AFPGA_PROGRAMMED, &svec->flags))
+		return -EAGAIN;
+
+	if (svec->sdb_blob && svec->sdb_blob_hash == svec->fw_hash &&
+	    svec->fw_hash != 0xffffffff)
+		return 0;
+
+	if (!svec->sdb_blob) {
+		svec->sdb_blob = kmalloc(SVEC_SDB_MAX_RECORDS *
+					 sizeof(union sdb_record), GFP_KERNEL);
+		if (!svec->sdb_blob)
+			return -ENOMEM;
+	}
+	svec->sdb_blob_len = 0;
+	ret = svec_sdb_scan_blob(svec, 0, 0, 0);
+	if (ret < 0) {
+		svec->sdb_blob_len = 0;
+		kfree(svec->sdb_blob);
+		svec->sdb_blob = NULL;
+		return ret;
+	}
+	svec->sdb_blob_hash = svec->fw_hash;
+	return 0;
+}
+
+ssize_t svec_sdb_read_blob(struct svec_dev *svec, char *buf, loff_t off,
+			   size_t count)
+{
+	ssize_t ret;
+
+	mutex_lock(&svec->sdb_lock);
+	ret = svec_sdb_update_blob(svec);
+	if (ret >= 0) {
+		if (off >= svec->sdb_blob_len) {
+			ret = 0;
+		} else {
+			ret = min_t(size_t, count, svec->sdb_blob_len - off);
+			memcpy(buf, svec->sdb_blob + off, ret);
+		}
+	}
+	mutex_unlock(&svec->sdb_lock);
+	return ret;
+}
+
+/* One line per device: vendor, device, first and last address, name */
+ssize_t svec_sdb_show_devices(struct svec_dev *svec, char *buf, size_t size)
+{
+	union sdb_record *r;
+	struct sdb_component *c;
+	ssize_t len = 0;
+	int i, n;
+
+	mutex_lock(&svec->sdb_lock);
+	len = svec_sdb_update_blob(svec);
+	if (len < 0) {
+		mutex_unlock(&svec->sdb_lock);
+		return len;
+	}
+
+	for (r = svec->sdb_blob; (void *)r < svec->sdb_blob + svec->sdb_blob_len;
+	     r++) {
+		if (r->empty.record_type != sdb_type_device)
+			continue;
+		c = &r->dev.sdb_component;
+		/* the name is padded with blanks, and not terminated */
+		for (n = sizeof(c->product.name); n > 0; n--)
+			if (c->product.name[n - 1] != ' ')
+				break;
+		i = scnprintf(buf + len, size - len,
+			      "0x%llx 0x%08x 0x%llx 0x%llx %.*s\n",
+			      (unsigned long long)be64_to_cpu(c->product.vendor_id),
+			      be32_to_cpu(c->product.device_id),
+			      (unsigned long long)be64_to_cpu(c->addr_first),
+			      (unsigned long long)be64_to_cpu(c->addr_last),
+			      n, (char *)c->product.name);
+		len += i;
+		if (len >= size - 1)
+			break;
+	}
+	mutex_unlock(&svec->sdb_lock);
+	return len;
+}
+
 static int svec_reprogram(struct fmc_device *fmc, struct fmc_driver *drv,
 			  char *gw)
 {
@@ -105,7 +379,7 @@ static int svec_read_ee(struct fmc_device *fmc, int pos, void *data, int len)
 {
 	if (!(fmc->flags & FMC_DEVICE_HAS_GOLDEN))
 		return -ENOTSUPP;
-	return svec_eeprom_read(fmc, pos, data, len);
+	return svec_eeprom_read_cached(fmc, pos, data, len);
 }
 
 static int svec_write_ee(struct fmc_device *fmc, int pos,
@@ -114,7 +388,7 @@ static int svec_write_ee(struct fmc_device *fmc, int pos,
 	if (!(fmc->flags & FMC_DEVICE_HAS_GOLDEN))
 		return -ENOTSUPP;
 		
-	return svec_eeprom_write(fmc, pos, data, len);
+	return svec_eeprom_write_cached(fmc, pos, data, len);
 }
 
 static struct fmc_operations svec_fmc_operations = {
@@ -142,17 +416,19 @@ static int check_golden(struct fmc_device *fmc)
 		dev_err(svec->dev, "Bad SDB magic: 0x%08x\n", magic);
 		return -ENODEV;
 	}
-	if ((ret = fmc_scan_sdb_tree(fmc, 0x0)) < 0)
+	if ((ret = svec_sdb_get(fmc)) < 0)
 		return -ENODEV;
 
 	vendor = fmc_readl(fmc, 0x5c);
 	if (vendor != 0x0000ce42) {
 		dev_err(svec->dev, "unsexpected vendor in SDB\n");
+		fmc_free_sdb_tree(fmc);
 		return -ENODEV;
 	}
 	device = fmc_readl(fmc, 0x60);
 	if (device != 0x676f6c64) {
 		dev_err(svec->dev, "unexpected device in SDB\n");
+		fmc_free_sdb_tree(fmc);
 		return -ENODEV;
 	}
 	if (svec_show_sdb)
@@ -190,10 +466,7 @@ int svec_fmc_prepare(struct svec_dev *svec, unsigned int fmc_slot)
 	fmc->eeprom_addr = 0x50 + 2 * fmc_slot;
 	fmc->memlen = svec->cfg_cur.vme_size;
 
-	/* check golden integrity */
-	/* FIXME: this uses fmc_scan_sdb_tree and de-allocation
-	 * could be wrong at second reprogramming, as it is called
-	 * n times, one per slot */
+	/* check golden integrity; the SDB tree is shared by the slots */
 
 	fmc->flags &= ~FMC_DEVICE_HAS_GOLDEN;
 	fmc->flags &= ~FMC_DEVICE_HAS_CUSTOM;
@@ -213,14 +486,8 @@ int svec_fmc_prepare(struct svec_dev *svec, unsigned int fmc_slot)
 	}
 
 	fmc->flags |= FMC_DEVICE_HAS_GOLDEN;
-	
-	ret = svec_i2c_init(fmc);
-	if (ret) {
-		dev_err(svec->dev, "Error %d on svec i2c init", ret);
-		kfree(fmc);
-		return ret;
-	}
 
+	/* the EEPROM is read later, for both slots at once */
 	svec->fmcs[fmc_slot] = fmc;
 	
 	if(svec->verbose)
@@ -243,6 +510,10 @@ int svec_fmc_create(struct svec_dev *svec)
 			goto failed;
 	}
 
+	error = svec_i2c_init_slots(svec);
+	if (error)
+		goto failed;
+
 	/* fmc device creation */
 	error = fmc_device_register_n(svec->fmcs, svec->fmcs_n);
 	if (error) {
@@ -259,9 +530,14 @@ int svec_fmc_create(struct svec_dev *svec)
 
       failed:
 
-	for (i = 0; i < svec->fmcs_n; i++)
-		if (svec->fmcs[i])
-			kfree(svec->fmcs[i]);
+	for (i = 0; i < svec->fmcs_n; i++) {
+		if (svec->fmcs[i]) {
+			svec_i2c_exit(svec->fmcs[i]);
+			fmc_free_sdb_tree(svec->fmcs[i]);
+		}
+		kfree(svec->fmcs[i]);
+		svec->fmcs[i] = NULL;
+	}
 
 	/* FIXME: free fmc allocations. */
 	return error;
@@ -270,10 +546,27 @@ int svec_fmc_create(struct svec_dev *svec)
 
 void svec_fmc_destroy(struct svec_dev *svec)
 {
+	int i;
+
 	if (!svec->fmcs[0])
 		return;
 
+	/*
+	 * The mezzanine drivers go first: they may have clients on the i2c
+	 * buses until their remove(). The fmc devices are held until the
+	 * adapters, which use them, are gone.
+	 */
+	for (i = 0; i < svec->fmcs_n; i++)
+		get_device(&svec->fmcs[i]->dev);
+
 	fmc_device_unregister_n(svec->fmcs, svec->fmcs_n);
+
+	for (i = 0; i < svec->fmcs_n; i++) {
+		svec_i2c_exit(svec->fmcs[i]);
+		fmc_free_sdb_tree(svec->fmcs[i]);
+		put_device(&svec->fmcs[i]->dev);
+	}
+	memset(svec->fmcs, 0, sizeof(svec->fmcs));
 	if(svec->verbose)
 	dev_info(svec->dev, "%d fmc devices unregistered\n", svec->fmcs_n);
 
@@ -11,12 +11,18 @@
  * option, any later version.
  */
 
+#include <linux/module.h>
 #include <linux/io.h>
 #include <linux/time.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
 #include <linux/fmc.h>
+#include <linux/fmc-sdb.h>
 #include "svec.h"
+#include "svec-trace.h"
 #include "hw/golden_regs.h"
 
 /* re-definitions for fields in golden core */
@@ -25,10 +31,79 @@
 #define GLD_I2CR_SDA_OUT	GLD_I2CR0_SDA_OUT
 #define GLD_I2CR_SCL_IN		GLD_I2CR0_SCL_IN
 #define GLD_I2CR_SDA_IN		GLD_I2CR0_SDA_IN
+#define GLD_I2CR_OUT		(GLD_I2CR_SCL_OUT | GLD_I2CR_SDA_OUT)
+
+/*
+ * OpenCores I2C master, as found in the general-cores library: 8-bit
+ * registers, 32 bits apart. Its clock is the wishbone clock of the gateware.
+ */
+#define OC_I2C_VENDOR		0xce42ULL
+#define OC_I2C_DEVICE		0x123c5443
+#define OC_I2C_PRER_LO		0x00
+#define OC_I2C_PRER_HI		0x04
+#define OC_I2C_CTR		0x08
+#define OC_I2C_TXR		0x0c
+#define OC_I2C_RXR		0x0c
+#define OC_I2C_CR		0x10
+#define OC_I2C_SR		0x10
+
+#define OC_I2C_CTR_EN		0x80
+#define OC_I2C_CR_STA		0x80
+#define OC_I2C_CR_STO		0x40
+#define OC_I2C_CR_RD		0x20
+#define OC_I2C_CR_WR		0x10
+#define OC_I2C_CR_NACK		0x08
+#define OC_I2C_SR_RXNACK	0x80
+#define OC_I2C_SR_BUSY		0x40
+#define OC_I2C_SR_AL		0x20
+#define OC_I2C_SR_TIP		0x02
+
+#define OC_I2C_TIMEOUT_MS	10
+
+/* VME accesses timed to calibrate the bit time */
+#define SVEC_I2C_CAL_ACCESSES		32
+/* part of the fastest VME write we do not count on, in percent */
+#define SVEC_I2C_CAL_MARGIN		25
+/* clock cycles of a one-byte random read: 4 bytes out, 1 in, 9 clocks each */
+#define SVEC_I2C_CAL_CLOCKS		45
+
+/* longest write cycle of the EEPROM we wait for (5ms in the 24C64 data sheet) */
+#define SVEC_EEPROM_WRITE_TIMEOUT_MS	20
 
 static int svec_i2c_dump;
 module_param_named(i2c_dump, svec_i2c_dump, int, 0444);
 
+/* EEPROM write page, in bytes (a power of two, 1 for byte writes) */
+static int svec_eeprom_page_size = 32;
+module_param_named(eeprom_page_size, svec_eeprom_page_size, int, 0644);
+
+/* clock of the EEPROM fast path, in kHz: 400 (fast mode) at most */
+static int svec_i2c_speed = 400;
+module_param_named(i2c_speed, svec_i2c_speed, int, 0444);
+
+/* wishbone clock of the gateware, in kHz, for the I2C master prescaler: it
+   can't be measured, 62.5 MHz is that of the usual SVEC gateware */
+static int svec_wb_clock_khz = 62500;
+module_param_named(wb_clock_khz, svec_wb_clock_khz, int, 0444);
+
+/* use the hardware I2C masters of the gateware, if it has them */
+static int svec_i2c_hw = 1;
+module_param_named(i2c_hw, svec_i2c_hw, int, 0444);
+
+/* read the whole EEPROM at init, not only the FRU information */
+static int svec_eeprom_prefetch;
+module_param_named(eeprom_prefetch, svec_eeprom_prefetch, int, 0444);
+
+/* time the EEPROM read with and without the shadow of the output bits */
+static int svec_i2c_bench;
+module_param_named(i2c_bench, svec_i2c_bench, int, 0444);
+
+/* i2c-algo-bit timing of the adapters: half clock period and SCL timeout */
+static int svec_i2c_udelay = 3;
+module_param_named(i2c_udelay, svec_i2c_udelay, int, 0444);
+static int svec_i2c_timeout_ms = 100;
+module_param_named(i2c_timeout_ms, svec_i2c_timeout_ms, int, 0444);
+
 static uint32_t core_offset[] = {
 	GLD_I2C_CORE_BASE + GLD_REG_I2CR0,
 	GLD_I2C_CORE_BASE + GLD_REG_I2CR1
@@ -70,26 +145,48 @@ static void dumpstruct(char *name, void *ptr, int size)
 		printk("\n");
 }
 
-static void set_sda(struct fmc_device *fmc, int val)
+/*
+ * Sets one output bit of the core, leaving the other one alone. Nobody else
+ * writes the outputs, so we keep a copy of them and every edge is a single
+ * VME write: only get_sda() and the SCL check of algo-bit read the bus.
+ */
+static void golden_set_bit(struct fmc_device *fmc, uint32_t bit, int val)
 {
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
 	uint32_t reg;
 
-	reg = golden_readl(fmc, 0) & ~GLD_I2CR_SDA_OUT;
+	if (i2c->shadowed)
+		reg = i2c->shadow;
+	else
+		reg = golden_readl(fmc, 0) & GLD_I2CR_OUT;
+	reg &= ~bit;
 	if (val)
-		reg |= GLD_I2CR_SDA_OUT;
+		reg |= bit;
+	i2c->shadow = reg;
 	golden_writel(fmc, reg, 0);
-	udelay(3);		/* FIXME: is this enough? */
 }
 
-static void set_scl(struct fmc_device *fmc, int val)
+/* the VME write of each edge is part of the bit time: see svec_i2c_calibrate */
+static void i2c_delay(struct fmc_device *fmc)
 {
-	uint32_t reg;
+	struct svec_dev *svec = fmc->carrier_data;
+	unsigned int ns = svec->i2c[fmc->slot_id].delay_ns;
 
-	reg = golden_readl(fmc, 0) & ~GLD_I2CR_SCL_OUT;
-	if (val)
-		reg |= GLD_I2CR_SCL_OUT;
-	golden_writel(fmc, reg, 0);
-	udelay(3);		/* FIXME: is this enough? */
+	if (ns)
+		ndelay(ns);
+}
+
+static void set_sda(struct fmc_device *fmc, int val)
+{
+	golden_set_bit(fmc, GLD_I2CR_SDA_OUT, val);
+	i2c_delay(fmc);
+}
+
+static void set_scl(struct fmc_device *fmc, int val)
+{
+	golden_set_bit(fmc, GLD_I2CR_SCL_OUT, val);
+	i2c_delay(fmc);
 }
 
 static int get_sda(struct fmc_device *fmc)
@@ -163,115 +260,1075 @@ void mi2c_init(struct fmc_device *fmc)
 	set_sda(fmc, 1);
 }
 
+/* The index-th instance of a core in the tree, like fmc_find_sdb_device() */
+static signed long svec_sdb_find_nth(struct sdb_array *tree, uint64_t vid,
+				     uint32_t did, int *index)
+{
+	signed long res;
+	union sdb_record *r;
+	struct sdb_product *p;
+	int i;
+
+	for (i = 0; i < tree->len; i++) {
+		r = &tree->record[i];
+		if (!IS_ERR_OR_NULL(tree->subtree[i])) {
+			res = svec_sdb_find_nth(tree->subtree[i], vid, did,
+						index);
+			if (res >= 0)
+				return res + tree->baseaddr;
+		}
+		if (r->empty.record_type != sdb_type_device)
+			continue;
+		p = &r->dev.sdb_component.product;
+		if (__be64_to_cpu(p->vendor_id) != vid ||
+		    __be32_to_cpu(p->device_id) != did)
+			continue;
+		if ((*index)-- == 0)
+			return tree->baseaddr +
+			    __be64_to_cpu(r->dev.sdb_component.addr_first);
+	}
+	return -ENODEV;
+}
+
+static void oc_writel(struct fmc_device *fmc, uint32_t val, int reg)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+
+	fmc_writel(fmc, val, svec->i2c[fmc->slot_id].hw_base + reg);
+}
+
+static uint32_t oc_readl(struct fmc_device *fmc, int reg)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+
+	return fmc_readl(fmc, svec->i2c[fmc->slot_id].hw_base + reg);
+}
+
+/* issues a command and waits for the byte transfer; -EIO if not acked */
+static int oc_cmd(struct fmc_device *fmc, uint32_t cmd)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(OC_I2C_TIMEOUT_MS);
+	uint32_t sr;
+
+	oc_writel(fmc, cmd, OC_I2C_CR);
+	while ((sr = oc_readl(fmc, OC_I2C_SR)) & OC_I2C_SR_TIP) {
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		cpu_relax();
+	}
+	if (sr & OC_I2C_SR_AL)
+		return -EAGAIN;
+	if ((cmd & OC_I2C_CR_WR) && (sr & OC_I2C_SR_RXNACK))
+		return -EIO;
+	return 0;
+}
+
+/* a stop sets no TIP: wait for the bus to be released, like i2c-ocores */
+static int oc_stop(struct fmc_device *fmc)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(OC_I2C_TIMEOUT_MS);
+
+	oc_writel(fmc, OC_I2C_CR_STO, OC_I2C_CR);
+	while (oc_readl(fmc, OC_I2C_SR) & OC_I2C_SR_BUSY) {
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		cpu_relax();
+	}
+	return 0;
+}
+
+/*
+ * The I2C engine of the slot: the hardware master when there is one, or
+ * the bit-banged golden core. The hardware master has no start command of
+ * its own, so a start is sent with the following byte.
+ */
+static void svec_i2c_start(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+
+	if (i2c->hw)
+		i2c->hw_start = 1;
+	else
+		mi2c_start(fmc);
+}
+
+static void svec_i2c_stop(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+
+	if (!i2c->hw) {
+		mi2c_stop(fmc);
+		return;
+	}
+	i2c->hw_start = 0;
+	oc_stop(fmc);
+}
+
+static int svec_i2c_put(struct fmc_device *fmc, int data)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	uint32_t cmd = OC_I2C_CR_WR;
+
+	if (!i2c->hw)
+		return mi2c_put_byte(fmc, data);
+
+	if (i2c->hw_start)
+		cmd |= OC_I2C_CR_STA;
+	i2c->hw_start = 0;
+	oc_writel(fmc, data & 0xff, OC_I2C_TXR);
+	return oc_cmd(fmc, cmd);
+}
+
+static int svec_i2c_get(struct fmc_device *fmc, unsigned char *data,
+			int sendack)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	if (!i2c->hw)
+		return mi2c_get_byte(fmc, data, sendack);
+
+	ret = oc_cmd(fmc, OC_I2C_CR_RD | (sendack ? 0 : OC_I2C_CR_NACK));
+	*data = oc_readl(fmc, OC_I2C_RXR);
+	return ret;
+}
+
+/*
+ * The hardware master of the slot, if the gateware has one: the n-th
+ * instance in the SDB tree is taken as the master of slot n, and only used
+ * if the EEPROM of the slot answers through it; a master wired to another
+ * bus leaves the slot bit-banged. Bus lock held.
+ */
+static void svec_i2c_hw_setup(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int index = fmc->slot_id;
+	signed long base;
+	unsigned int prescale;
+
+	i2c->hw = 0;
+	if (!svec_i2c_hw || !fmc->sdb)
+		return;
+	base = svec_sdb_find_nth(fmc->sdb, OC_I2C_VENDOR, OC_I2C_DEVICE,
+				 &index);
+	if (base < 0)
+		return;
+
+	i2c->hw_base = base;
+	i2c->hw_start = 0;
+	i2c->hw = 1;
+
+	/* SCL is the wishbone clock divided by 5 * (prescale + 1): round the
+	   divider up, so that SCL never exceeds i2c_speed */
+	prescale = DIV_ROUND_UP(max(svec_wb_clock_khz, 1),
+				5 * clamp(svec_i2c_speed, 1, 400));
+	prescale = prescale ? prescale - 1 : 0;
+	oc_writel(fmc, 0, OC_I2C_CTR);
+	oc_writel(fmc, prescale & 0xff, OC_I2C_PRER_LO);
+	oc_writel(fmc, (prescale >> 8) & 0xff, OC_I2C_PRER_HI);
+	oc_writel(fmc, OC_I2C_CTR_EN, OC_I2C_CTR);
+
+	svec_i2c_start(fmc);
+	if (!svec_i2c_put(fmc, fmc->eeprom_addr << 1)) {
+		svec_i2c_stop(fmc);
+		return;
+	}
+	svec_i2c_stop(fmc);
+	oc_writel(fmc, 0, OC_I2C_CTR);
+	i2c->hw = 0;
+
+	if(svec->verbose)
+	dev_info(fmc->hwdev, "Mezzanine %d: no EEPROM behind the i2c master "
+		 "at 0x%lx, bit-banging\n", fmc->slot_id + 1, base);
+}
+
 void mi2c_scan(struct fmc_device *fmc)
 {
 	int i;
 	for (i = 0; i < 256; i += 2) {
-		mi2c_start(fmc);
-		if (!mi2c_put_byte(fmc, i))
+		svec_i2c_start(fmc);
+		if (!svec_i2c_put(fmc, i))
 			pr_info("%s: Found i2c device at 0x%x\n",
 				KBUILD_MODNAME, i >> 1);
-		mi2c_stop(fmc);
+		svec_i2c_stop(fmc);
 	}
 }
 
-int svec_eeprom_read(struct fmc_device *fmc, uint32_t offset,
-		     void *buf, size_t size)
+/*
+ * The driver's own access to the mezzanine EEPROM does not go through the
+ * i2c core: these are the fast path of the carrier, used at
+ * init time and by read_ee/write_ee. They share the bus lock with the
+ * adapter, which the callers of the _do_ versions hold.
+ */
+static int svec_eeprom_do_read(struct fmc_device *fmc, uint32_t offset,
+			       void *buf, size_t size)
 {
 	unsigned char c;
 	int ret = size;
 	uint8_t *buf8 = buf;
 	int i2c_addr = fmc->eeprom_addr;
+	u64 t = local_clock();
 
-	mi2c_start(fmc);
-	if (mi2c_put_byte(fmc, i2c_addr << 1) < 0) {
-		mi2c_stop(fmc);
+	svec_i2c_start(fmc);
+	if (svec_i2c_put(fmc, i2c_addr << 1) < 0) {
+		svec_i2c_stop(fmc);
 		return -EIO;
 	}
 
-	mi2c_put_byte(fmc, (offset >> 8) & 0xff);
-	mi2c_put_byte(fmc, offset & 0xff);
-	mi2c_stop(fmc);
-	mi2c_start(fmc);
-	mi2c_put_byte(fmc, (i2c_addr << 1) | 1);
+	svec_i2c_put(fmc, (offset >> 8) & 0xff);
+	svec_i2c_put(fmc, offset & 0xff);
+	svec_i2c_stop(fmc);
+	svec_i2c_start(fmc);
+	svec_i2c_put(fmc, (i2c_addr << 1) | 1);
 	while (size--) {
-		mi2c_get_byte(fmc, &c, size != 0);
+		svec_i2c_get(fmc, &c, size != 0);
 		*buf8++ = c;
 	}
-	mi2c_stop(fmc);
+	svec_i2c_stop(fmc);
+	if (svec_trace_enabled(svec_eeprom_xfer))
+		trace_svec_eeprom_xfer(fmc->carrier_data, fmc->slot_id, offset, ret,
+				       local_clock() - t);
 	return ret;
 }
 
-int svec_eeprom_write(struct fmc_device *fmc, uint32_t offset,
-		      const void *buf, size_t size)
+/* the chip ignores its address while it completes a write cycle */
+static int svec_eeprom_wait_ready(struct fmc_device *fmc)
 {
-	int i, busy;
+	unsigned long timeout;
+	int busy;
+
+	timeout = jiffies + msecs_to_jiffies(SVEC_EEPROM_WRITE_TIMEOUT_MS);
+	do {
+		svec_i2c_start(fmc);
+		busy = svec_i2c_put(fmc, fmc->eeprom_addr << 1);
+		svec_i2c_stop(fmc);
+		if (!busy)
+			return 0;
+	} while (time_before(jiffies, timeout));
+	return -ETIMEDOUT;
+}
+
+static int svec_eeprom_page(void)
+{
+	int page = svec_eeprom_page_size;
+
+	if (page < 1 || page > 256 || (page & (page - 1)))
+		return 1;
+	return page;
+}
+
+/* Writes never cross a page, and each page is a single write cycle */
+static int svec_eeprom_do_write(struct fmc_device *fmc, uint32_t offset,
+				const void *buf, size_t size)
+{
+	int i, n, ret;
 	const uint8_t *buf8 = buf;
 	int i2c_addr = fmc->eeprom_addr;
+	int page = svec_eeprom_page();
+	size_t done;
 
-	for (i = 0; i < size; i++) {
-		mi2c_start(fmc);
+	for (done = 0; done < size; done += n, offset += n) {
+		n = min_t(size_t, size - done, page - (offset & (page - 1)));
 
-		if (mi2c_put_byte(fmc, i2c_addr << 1) < 0) {
-			mi2c_stop(fmc);
-			return -1;
+		svec_i2c_start(fmc);
+		if (svec_i2c_put(fmc, i2c_addr << 1) < 0) {
+			svec_i2c_stop(fmc);
+			return -EIO;
 		}
-		mi2c_put_byte(fmc, (offset >> 8) & 0xff);
-		mi2c_put_byte(fmc, offset & 0xff);
-		mi2c_put_byte(fmc, *buf8++);
-		offset++;
-		mi2c_stop(fmc);
+		svec_i2c_put(fmc, (offset >> 8) & 0xff);
+		svec_i2c_put(fmc, offset & 0xff);
+		for (i = 0; i < n; i++)
+			svec_i2c_put(fmc, *buf8++);
+		svec_i2c_stop(fmc);
 
-		do {		/* wait until the chip becomes ready */
-			mi2c_start(fmc);
-			busy = mi2c_put_byte(fmc, i2c_addr << 1);
-			mi2c_stop(fmc);
-		} while (busy);
+		ret = svec_eeprom_wait_ready(fmc);
+		if (ret < 0) {
+			dev_err(fmc->hwdev, "Mezzanine %d: EEPROM write timeout "
+				"at 0x%x\n", fmc->slot_id + 1, offset);
+			return ret;
+		}
 	}
 	return size;
 }
 
+int svec_eeprom_read(struct fmc_device *fmc, uint32_t offset,
+		     void *buf, size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	mutex_lock(&i2c->lock);
+	ret = svec_eeprom_do_read(fmc, offset, buf, size);
+	mutex_unlock(&i2c->lock);
+	return ret;
+}
+
+int svec_eeprom_write(struct fmc_device *fmc, uint32_t offset,
+		      const void *buf, size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	mutex_lock(&i2c->lock);
+	ret = svec_eeprom_do_write(fmc, offset, buf, size);
+	mutex_unlock(&i2c->lock);
+	return ret;
+}
+
+/*
+ * EEPROM cache. The image is read in chunks, when first accessed: at init
+ * we only fetch the FRU information the fmc bus parses. The image belongs
+ * to the card, not to the fmc device, so that it survives reconfiguration;
+ * it is dropped when the mezzanine changes. Called with the bus lock held.
+ */
+/*
+ * fmc->eeprom shows the image up to the first chunk not read (or dropped):
+ * the bytes past eeprom_len are not the EEPROM's. Bus lock held.
+ */
+static void svec_eeprom_update_len(struct svec_i2c *i2c)
+{
+	struct fmc_device *fmc = i2c->fmc;
+
+	if (!fmc || fmc->eeprom != i2c->eeprom)
+		return;
+	fmc->eeprom_len = find_first_zero_bit(i2c->valid,
+					      SVEC_I2C_EEPROM_CHUNKS) *
+	    SVEC_I2C_EEPROM_CHUNK;
+}
+
+/* Drops the chunks of a range, to be read again. Bus lock held. */
+static void svec_eeprom_invalidate(struct svec_i2c *i2c, uint32_t offset,
+				   size_t size)
+{
+	int chunk, last;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE || !size)
+		return;
+	size = min_t(size_t, size, SVEC_I2C_EEPROM_SIZE - offset);
+
+	last = (offset + size - 1) / SVEC_I2C_EEPROM_CHUNK;
+	for (chunk = offset / SVEC_I2C_EEPROM_CHUNK; chunk <= last; chunk++)
+		clear_bit(chunk, i2c->valid);
+	svec_eeprom_update_len(i2c);
+}
+
+static int svec_eeprom_fill(struct fmc_device *fmc, uint32_t offset,
+			    size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int chunk, last, ret;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE || !size)
+		return 0;
+	size = min_t(size_t, size, SVEC_I2C_EEPROM_SIZE - offset);
+
+	last = (offset + size - 1) / SVEC_I2C_EEPROM_CHUNK;
+	for (chunk = offset / SVEC_I2C_EEPROM_CHUNK; chunk <= last; chunk++) {
+		if (test_bit(chunk, i2c->valid))
+			continue;
+		ret = svec_eeprom_do_read(fmc, chunk * SVEC_I2C_EEPROM_CHUNK,
+					  i2c->eeprom +
+					  chunk * SVEC_I2C_EEPROM_CHUNK,
+					  SVEC_I2C_EEPROM_CHUNK);
+		if (ret < 0)
+			return ret;
+		set_bit(chunk, i2c->valid);
+	}
+	svec_eeprom_update_len(i2c);
+	return 0;
+}
+
+/* The IPMI FRU common header, and the areas it points to */
+static int svec_eeprom_fill_fru(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	uint8_t *ee = svec->i2c[fmc->slot_id].eeprom;
+	int i, off, len, ret;
+
+	ret = svec_eeprom_fill(fmc, 0, 8);
+	if (ret < 0 || ee[0] != 1)	/* no FRU: nothing more we know of */
+		return ret;
+
+	/* chassis, board and product areas: length in the second byte */
+	for (i = 2; i <= 4; i++) {
+		off = ee[i] * 8;
+		if (!off)
+			continue;
+		ret = svec_eeprom_fill(fmc, off, 2);
+		if (ret < 0)
+			return ret;
+		if (off + 1 < SVEC_I2C_EEPROM_SIZE)
+			len = ee[off + 1] * 8;
+		else
+			len = 0;
+		ret = svec_eeprom_fill(fmc, off, len);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* multi-record area: a list of records with a 5-byte header */
+	for (off = ee[5] * 8; off && off + 5 <= SVEC_I2C_EEPROM_SIZE;
+	     off += 5 + len) {
+		ret = svec_eeprom_fill(fmc, off, 5);
+		if (ret < 0)
+			return ret;
+		len = ee[off + 2];
+		ret = svec_eeprom_fill(fmc, off + 5, len);
+		if (ret < 0)
+			return ret;
+		if (ee[off + 1] & 0x80)	/* end of list */
+			break;
+	}
+	return 0;
+}
+
+int svec_eeprom_read_cached(struct fmc_device *fmc, uint32_t offset,
+			    void *buf, size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE ||
+	    size > SVEC_I2C_EEPROM_SIZE - offset)
+		return -EINVAL;
+
+	mutex_lock(&i2c->lock);
+	ret = svec_eeprom_fill(fmc, offset, size);
+	if (ret >= 0) {
+		memcpy(buf, i2c->eeprom + offset, size);
+		ret = size;
+	}
+	mutex_unlock(&i2c->lock);
+	return ret;
+}
+
+/* Writes through the cache; after an error the chunks are read again */
+static int svec_eeprom_cache_write(struct fmc_device *fmc, uint32_t offset,
+				   const void *buf, size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	ret = svec_eeprom_do_write(fmc, offset, buf, size);
+	memcpy(i2c->eeprom + offset, buf, size);
+	if (ret < 0)
+		svec_eeprom_invalidate(i2c, offset, size);
+	return ret;
+}
+
+int svec_eeprom_write_cached(struct fmc_device *fmc, uint32_t offset,
+			     const void *buf, size_t size)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE ||
+	    size > SVEC_I2C_EEPROM_SIZE - offset)
+		return -EINVAL;
+	if (!size)
+		return 0;
+
+	mutex_lock(&i2c->lock);
+	ret = svec_eeprom_cache_write(fmc, offset, buf, size);
+	mutex_unlock(&i2c->lock);
+	return ret;
+}
+
+/*
+ * Access by slot, for the fmc<N>_eeprom sysfs files: the fmc device may be
+ * gone, or running its own gateware. Returns the fmc device with the bus
+ * locked, or NULL.
+ */
+static struct fmc_device *svec_eeprom_slot_lock(struct svec_dev *svec,
+						int slot)
+{
+	struct svec_i2c *i2c = &svec->i2c[slot];
+
+	mutex_lock(&i2c->lock);
+	if (i2c->fmc && i2c->present &&
+	    (i2c->fmc->flags & FMC_DEVICE_HAS_GOLDEN))
+		return i2c->fmc;
+	mutex_unlock(&i2c->lock);
+	return NULL;
+}
+
+ssize_t svec_eeprom_slot_read(struct svec_dev *svec, int slot,
+			      uint32_t offset, void *buf, size_t size)
+{
+	struct svec_i2c *i2c = &svec->i2c[slot];
+	struct fmc_device *fmc;
+	int ret;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE)
+		return 0;
+	size = min_t(size_t, size, SVEC_I2C_EEPROM_SIZE - offset);
+
+	fmc = svec_eeprom_slot_lock(svec, slot);
+	if (!fmc)
+		return -ENODEV;
+	ret = svec_eeprom_fill(fmc, offset, size);
+	if (ret >= 0)
+		memcpy(buf, i2c->eeprom + offset, size);
+	mutex_unlock(&i2c->lock);
+	return ret < 0 ? ret : size;
+}
+
+/*
+ * Only what differs from the image is written: in each page, the bytes
+ * from the first to the last one which changed. Rewriting a serial number
+ * costs a write cycle or two, and no wear on the rest of the chip.
+ */
+ssize_t svec_eeprom_slot_write(struct svec_dev *svec, int slot,
+			       uint32_t offset, const void *buf, size_t size)
+{
+	struct svec_i2c *i2c = &svec->i2c[slot];
+	struct fmc_device *fmc;
+	const uint8_t *buf8 = buf;
+	int page = svec_eeprom_page();
+	int ret, first, last, i, n, pages = 0;
+	size_t done;
+
+	if (offset >= SVEC_I2C_EEPROM_SIZE)
+		return -ENOSPC;
+	size = min_t(size_t, size, SVEC_I2C_EEPROM_SIZE - offset);
+
+	fmc = svec_eeprom_slot_lock(svec, slot);
+	if (!fmc)
+		return -ENODEV;
+	ret = svec_eeprom_fill(fmc, offset, size);
+	for (done = 0; ret >= 0 && done < size; done += n) {
+		n = min_t(size_t, size - done,
+			  page - ((offset + done) & (page - 1)));
+
+		for (first = -1, last = -1, i = 0; i < n; i++) {
+			if (buf8[done + i] == i2c->eeprom[offset + done + i])
+				continue;
+			if (first < 0)
+				first = i;
+			last = i;
+		}
+		if (first < 0)
+			continue;
+		ret = svec_eeprom_cache_write(fmc, offset + done + first,
+					      buf8 + done + first,
+					      last - first + 1);
+		pages++;
+	}
+	mutex_unlock(&i2c->lock);
+
+	if (ret >= 0 && svec->verbose)
+		dev_info(svec->dev, "Mezzanine %d: EEPROM 0x%x+%zu: "
+			 "%d pages written\n", slot + 1, offset, size, pages);
+	return ret < 0 ? ret : size;
+}
+
+/*
+ * i2c-algo-bit adapter, for at24, i2c-dev and the other mezzanine chips.
+ * The callbacks only move the lines: the timing is algo-bit's own.
+ */
+static void svec_i2c_setsda(void *data, int state)
+{
+	struct svec_i2c *i2c = data;
+
+	golden_set_bit(i2c->fmc, GLD_I2CR_SDA_OUT, state);
+}
+
+static void svec_i2c_setscl(void *data, int state)
+{
+	struct svec_i2c *i2c = data;
+
+	golden_set_bit(i2c->fmc, GLD_I2CR_SCL_OUT, state);
+}
+
+static int svec_i2c_getsda(void *data)
+{
+	struct svec_i2c *i2c = data;
+
+	return get_sda(i2c->fmc);
+}
+
+static int svec_i2c_getscl(void *data)
+{
+	struct svec_i2c *i2c = data;
+
+	return golden_readl(i2c->fmc, 0) & GLD_I2CR_SCL_IN ? 1 : 0;
+}
+
+/* the core is only there while the golden gateware is loaded */
+static int svec_i2c_pre_xfer(struct i2c_adapter *adap)
+{
+	struct svec_i2c *i2c = i2c_get_adapdata(adap);
+
+	mutex_lock(&i2c->lock);
+	if (!(i2c->fmc->flags & FMC_DEVICE_HAS_GOLDEN)) {
+		mutex_unlock(&i2c->lock);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+/*
+ * Writes to the EEPROM through the adapter (at24, i2c-dev) bypass the image:
+ * the chunks they touch are dropped. A write message starts with the 16-bit
+ * offset; one with nothing more only sets the address of a read. The EEPROM
+ * wraps a write around within its page, whatever eeprom_page_size says, and
+ * a page (256 bytes at most) never spans two chunks: the chunk of the offset
+ * is the one to drop.
+ */
+static void svec_i2c_post_xfer(struct i2c_adapter *adap)
+{
+	struct svec_i2c *i2c = i2c_get_adapdata(adap);
+	struct i2c_msg *msg;
+	uint32_t offset;
+	int i;
+
+	for (i = 0; i < i2c->xfer_num; i++) {
+		msg = &i2c->xfer_msgs[i];
+		if (msg->addr != i2c->fmc->eeprom_addr ||
+		    (msg->flags & I2C_M_RD) || msg->len <= 2)
+			continue;
+		offset = ((msg->buf[0] << 8) | msg->buf[1]) % SVEC_I2C_EEPROM_SIZE;
+		svec_eeprom_invalidate(i2c, offset & ~(SVEC_I2C_EEPROM_CHUNK - 1),
+				       SVEC_I2C_EEPROM_CHUNK);
+	}
+	i2c->xfer_msgs = NULL;
+	i2c->xfer_num = 0;
+	mutex_unlock(&i2c->lock);
+}
+
+/* algo-bit, telling svec_i2c_post_xfer() what the transfer was */
+static int svec_i2c_bit_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			     int num)
+{
+	struct svec_i2c *i2c = i2c_get_adapdata(adap);
+
+	/* the i2c core runs one transfer at a time on the adapter */
+	i2c->xfer_msgs = msgs;
+	i2c->xfer_num = num;
+	return i2c_bit_algo.master_xfer(adap, msgs, num);
+}
+
+static u32 svec_i2c_bit_func(struct i2c_adapter *adap)
+{
+	return i2c_bit_algo.functionality(adap);
+}
+
+static const struct i2c_algorithm svec_i2c_bit_algo = {
+	.master_xfer = svec_i2c_bit_xfer,
+	.functionality = svec_i2c_bit_func,
+};
+
+/* With a hardware master, the adapter uses it like the fast path does */
+static int svec_i2c_hw_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			    int num)
+{
+	struct svec_i2c *i2c = i2c_get_adapdata(adap);
+	struct fmc_device *fmc;
+	int i, j, rd, ret;
+
+	ret = svec_i2c_pre_xfer(adap);
+	if (ret)
+		return ret;
+	fmc = i2c->fmc;
+	i2c->xfer_msgs = msgs;
+	i2c->xfer_num = num;
+
+	for (i = 0; !ret && i < num; i++) {
+		rd = msgs[i].flags & I2C_M_RD;
+		svec_i2c_start(fmc);
+		ret = svec_i2c_put(fmc, (msgs[i].addr << 1) | (rd ? 1 : 0));
+		for (j = 0; !ret && j < msgs[i].len; j++) {
+			if (rd)
+				ret = svec_i2c_get(fmc, &msgs[i].buf[j],
+						   j != msgs[i].len - 1);
+			else
+				ret = svec_i2c_put(fmc, msgs[i].buf[j]);
+		}
+	}
+	svec_i2c_stop(fmc);
+
+	svec_i2c_post_xfer(adap);
+	return ret ? ret : num;
+}
+
+static u32 svec_i2c_hw_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm svec_i2c_hw_algo = {
+	.master_xfer = svec_i2c_hw_xfer,
+	.functionality = svec_i2c_hw_func,
+};
+
+static int svec_i2c_add_adapter(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	int ret;
+
+	memset(&i2c->adap, 0, sizeof(i2c->adap));
+	memset(&i2c->bit, 0, sizeof(i2c->bit));
+
+	i2c->adap.owner = THIS_MODULE;
+	i2c->adap.dev.parent = svec->dev;
+	snprintf(i2c->adap.name, sizeof(i2c->adap.name), "%s-fmc%d",
+		 svec->name, fmc->slot_id);
+	i2c_set_adapdata(&i2c->adap, i2c);
+
+	if (i2c->hw) {
+		i2c->adap.algo = &svec_i2c_hw_algo;
+		i2c->adap.timeout = msecs_to_jiffies(svec_i2c_timeout_ms);
+		ret = i2c_add_adapter(&i2c->adap);
+	} else {
+		i2c->bit.data = i2c;
+		i2c->bit.setsda = svec_i2c_setsda;
+		i2c->bit.setscl = svec_i2c_setscl;
+		i2c->bit.getsda = svec_i2c_getsda;
+		i2c->bit.getscl = svec_i2c_getscl;
+		i2c->bit.pre_xfer = svec_i2c_pre_xfer;
+		i2c->bit.post_xfer = svec_i2c_post_xfer;
+		i2c->bit.udelay = svec_i2c_udelay;
+		i2c->bit.timeout = msecs_to_jiffies(svec_i2c_timeout_ms);
+		/* what i2c_bit_add_bus() does, with our own master_xfer */
+		i2c->adap.algo = &svec_i2c_bit_algo;
+		i2c->adap.algo_data = &i2c->bit;
+		i2c->adap.timeout = i2c->bit.timeout;
+		i2c->adap.retries = 3;
+		ret = i2c_add_adapter(&i2c->adap);
+	}
+	if (ret)
+		return ret;
+	i2c->registered = 1;
+
+	if(svec->verbose)
+	dev_info(fmc->hwdev, "Mezzanine %d: i2c adapter %s is i2c-%d\n",
+		 fmc->slot_id + 1, i2c->adap.name, i2c->adap.nr);
+	return 0;
+}
+
+/* reads the whole EEPROM in both ways, and reports the times */
+static void svec_i2c_do_bench(struct fmc_device *fmc, void *buf)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	u64 t, ns[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		mutex_lock(&i2c->lock);
+		i2c->shadowed = i;
+		mutex_unlock(&i2c->lock);
+
+		t = local_clock();
+		if (svec_eeprom_read(fmc, 0, buf, SVEC_I2C_EEPROM_SIZE) < 0)
+			ns[i] = 0;
+		else
+			ns[i] = local_clock() - t;
+	}
+
+	dev_info(fmc->hwdev, "Mezzanine %d: EEPROM read (%d bytes): "
+		 "%llu us read-modify-write, %llu us shadowed\n",
+		 fmc->slot_id + 1, SVEC_I2C_EEPROM_SIZE,
+		 (unsigned long long)div_u64(ns[0], 1000),
+		 (unsigned long long)div_u64(ns[1], 1000));
+}
+
+/*
+ * Each edge of the fast path is a VME write, which takes about as long as
+ * an I2C low period in fast mode: we time the accesses and only wait for
+ * what is missing to the minimum SCL low time (4.7us at 100kHz, 1.3us at
+ * 400kHz) or to the half period of a slower i2c_speed. We count on the
+ * fastest access we see, less a margin, so a quiet bus can't shorten the
+ * low time below the minimum. Bus lock held, the other slot idle.
+ */
+static void svec_i2c_calibrate(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	unsigned int speed, t_low, ns, cover;
+	u64 t;
+	int i;
+
+	/* reads are not posted: each one is a sample */
+	i2c->read_ns = ~0U;
+	for (i = 0; i < SVEC_I2C_CAL_ACCESSES; i++) {
+		t = local_clock();
+		golden_readl(fmc, 0);
+		ns = local_clock() - t;
+		i2c->read_ns = min(i2c->read_ns, ns);
+	}
+
+	/*
+	 * The writes may be: each is flushed by a read, that we take off.
+	 * The outputs do not move: we write the value they already have.
+	 */
+	i2c->write_ns = ~0U;
+	for (i = 0; i < SVEC_I2C_CAL_ACCESSES; i++) {
+		t = local_clock();
+		golden_writel(fmc, i2c->shadow, 0);
+		golden_readl(fmc, 0);
+		ns = local_clock() - t;
+		ns = ns > i2c->read_ns ? ns - i2c->read_ns : 0;
+		i2c->write_ns = min(i2c->write_ns, ns);
+	}
+
+	speed = clamp(svec_i2c_speed, 1, 400);
+	t_low = max(speed > 100 ? 1300U : 4700U, 500000U / speed);
+	cover = i2c->write_ns - i2c->write_ns * SVEC_I2C_CAL_MARGIN / 100;
+	i2c->delay_ns = t_low > cover ? t_low - cover : 0;
+	i2c->khz = 0;
+}
+
+/* the bit rate we get, timing a one-byte read. Bus lock held. */
+static void svec_i2c_measure(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	unsigned char c;
+	u64 t;
+
+	t = local_clock();
+	if (svec_eeprom_do_read(fmc, 0, &c, 1) < 0)
+		return;
+	t = local_clock() - t;
+	i2c->khz = div64_u64(SVEC_I2C_CAL_CLOCKS * 1000000ULL, max_t(u64, t, 1));
+}
+
+/*
+ * Checks the mezzanine is still the one we have in the cache: we only
+ * compare the FRU common header, which has a checksum. Bus lock held.
+ */
+static int svec_eeprom_check_cache(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+	uint8_t header[8];
+	int ret;
+
+	if (!i2c->present || !test_bit(0, i2c->valid))
+		goto invalidate;
+	ret = svec_eeprom_do_read(fmc, 0, header, sizeof(header));
+	if (ret < 0)
+		return ret;
+	if (!memcmp(header, i2c->eeprom, sizeof(header)))
+		return 0;
+
+      invalidate:
+	bitmap_zero(i2c->valid, SVEC_I2C_EEPROM_CHUNKS);
+	i2c->present = 1;
+	return 0;
+}
+
 int svec_i2c_init(struct fmc_device *fmc)
 {
-	void *buf;
+	unsigned long last;
 	int i;
 	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
 
-	if(svec->verbose)
-	mi2c_scan(fmc);
+	i2c->fmc = fmc;
+
+	/* the bit-bang path is calibrated already, see svec_i2c_init_slots */
+	mutex_lock(&i2c->lock);
+	svec_i2c_hw_setup(fmc);
+	mutex_unlock(&i2c->lock);
+
+	if(svec->verbose) {
+		mutex_lock(&i2c->lock);
+		mi2c_scan(fmc);
+		mutex_unlock(&i2c->lock);
+	}
 
 	if (!mezzanine_present(fmc)) {
 		fmc->flags |= FMC_DEVICE_NO_MEZZANINE;
+		i2c->present = 0;
 		return 0;
 	}
 
-	buf = kmalloc(SVEC_I2C_EEPROM_SIZE, GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	if (!i2c->eeprom) {
+		i2c->eeprom = kzalloc(SVEC_I2C_EEPROM_SIZE, GFP_KERNEL);
+		if (!i2c->eeprom) {
+			i2c->fmc = NULL;
+			return -ENOMEM;
+		}
+		i2c->present = 0;
+	}
 
-	i = svec_eeprom_read(fmc, 0, buf, SVEC_I2C_EEPROM_SIZE);
-	if (i != SVEC_I2C_EEPROM_SIZE) {
+	mutex_lock(&i2c->lock);
+	svec_i2c_measure(fmc);
+	i = svec_eeprom_check_cache(fmc);
+	if (i >= 0) {
+		if (svec_eeprom_prefetch || svec_i2c_dump)
+			i = svec_eeprom_fill(fmc, 0, SVEC_I2C_EEPROM_SIZE);
+		else
+			i = svec_eeprom_fill_fru(fmc);
+	}
+	/* fill the holes, so that eeprom_len covers all of the FRU areas */
+	last = find_last_bit(i2c->valid, SVEC_I2C_EEPROM_CHUNKS);
+	if (i >= 0 && last < SVEC_I2C_EEPROM_CHUNKS)
+		i = svec_eeprom_fill(fmc, 0, (last + 1) * SVEC_I2C_EEPROM_CHUNK);
+	mutex_unlock(&i2c->lock);
+	if (i < 0) {
 		dev_err(fmc->hwdev, "EEPROM read error: %i\n", i);
-		kfree(buf);
+		i2c->present = 0;
+		i2c->fmc = NULL;	/* the caller frees it */
 		fmc->eeprom = NULL;
 		fmc->eeprom_len = 0;
 		return -EIO;
 	} else if (svec->verbose) {
-		dev_info(fmc->hwdev, "Mezzanine %d, i2c 0x%x: EEPROM read ok\n",
-			 fmc->slot_id + 1, fmc->eeprom_addr);
+		dev_info(fmc->hwdev, "Mezzanine %d: %s i2c at %u kHz (VME write "
+			 "%u ns, read %u ns, delay %u ns)\n", fmc->slot_id + 1,
+			 i2c->hw ? "hardware" : "bit-banged", i2c->khz,
+			 i2c->write_ns, i2c->read_ns, i2c->hw ? 0 : i2c->delay_ns);
+		dev_info(fmc->hwdev, "Mezzanine %d, i2c 0x%x: EEPROM read ok, "
+			 "%d bytes cached\n", fmc->slot_id + 1, fmc->eeprom_addr,
+			 bitmap_weight(i2c->valid, SVEC_I2C_EEPROM_CHUNKS) *
+			 SVEC_I2C_EEPROM_CHUNK);
 	}
-	fmc->eeprom = buf;
-	fmc->eeprom_len = SVEC_I2C_EEPROM_SIZE;
+	/* eeprom_len grows as chunks are read through read_ee */
+	mutex_lock(&i2c->lock);
+	fmc->eeprom = i2c->eeprom;
+	svec_eeprom_update_len(i2c);
+	mutex_unlock(&i2c->lock);
 
 	if (svec_i2c_dump)
-		dumpstruct("eeprom", buf, SVEC_I2C_EEPROM_SIZE);
+		dumpstruct("eeprom", i2c->eeprom, SVEC_I2C_EEPROM_SIZE);
+
+	if (svec_i2c_bench) {
+		void *scratch = kmalloc(SVEC_I2C_EEPROM_SIZE, GFP_KERNEL);
 
+		if (scratch) {
+			svec_i2c_do_bench(fmc, scratch);
+			kfree(scratch);
+		}
+	}
+
+	/* the adapter is a convenience: the FMC device works without it */
+	i = svec_i2c_add_adapter(fmc);
+	if (i)
+		dev_warn(fmc->hwdev, "Mezzanine %d: no i2c adapter: %d\n",
+			 fmc->slot_id + 1, i);
 	return 0;
 }
 
 void svec_i2c_exit(struct fmc_device *fmc)
 {
-	kfree(fmc->eeprom);
+	struct svec_dev *svec = fmc->carrier_data;
+	struct svec_i2c *i2c = &svec->i2c[fmc->slot_id];
+
+	if (i2c->registered) {
+		i2c_del_adapter(&i2c->adap);
+		i2c->registered = 0;
+	}
+	/* the image stays in the cache, for the next fmc device */
+	mutex_lock(&i2c->lock);
+	i2c->fmc = NULL;
+	mutex_unlock(&i2c->lock);
 	fmc->eeprom = NULL;
 	fmc->eeprom_len = 0;
 }
+
+static void svec_i2c_init_work(struct work_struct *work)
+{
+	struct svec_i2c *i2c = container_of(work, struct svec_i2c, init_work);
+
+	i2c->init_ret = svec_i2c_init(i2c->fmc);
+}
+
+/*
+ * The buses of the two slots are separate cores, with a lock each: the
+ * mezzanines are probed and their EEPROMs read at the same time, by
+ * workers of their own. The VME timings are taken before, one slot at a
+ * time, so that the traffic of the other slot does not inflate them.
+ */
+int svec_i2c_init_slots(struct svec_dev *svec)
+{
+	struct svec_i2c *i2c;
+	u64 t = local_clock();
+	int i, ret = 0;
+
+	for (i = 0; i < svec->fmcs_n; i++) {
+		i2c = &svec->i2c[i];
+		i2c->fmc = svec->fmcs[i];
+		mutex_lock(&i2c->lock);
+		i2c->shadow = golden_readl(i2c->fmc, 0) & GLD_I2CR_OUT;
+		i2c->shadowed = 1;
+		svec_i2c_calibrate(i2c->fmc);
+		mutex_unlock(&i2c->lock);
+	}
+
+	for (i = 0; i < svec->fmcs_n; i++) {
+		i2c = &svec->i2c[i];
+		i2c->init_ret = 0;
+		INIT_WORK(&i2c->init_work, svec_i2c_init_work);
+		queue_work(system_unbound_wq, &i2c->init_work);
+	}
+
+	for (i = 0; i < svec->fmcs_n; i++) {
+		i2c = &svec->i2c[i];
+		flush_work(&i2c->init_work);
+		if (!i2c->init_ret)
+			continue;
+		dev_err(svec->dev, "Error %d on svec i2c init, slot %d\n",
+			i2c->init_ret, i);
+		if (!ret)
+			ret = i2c->init_ret;
+	}
+
+	if(svec->verbose)
+	dev_info(svec->dev, "mezzanines probed in %llu us\n",
+		 (unsigned long long)div_u64(local_clock() - t, 1000));
+	return ret;
+}
+
+ssize_t svec_i2c_show_status(struct svec_dev *svec, char *buf, size_t size)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < SVEC_N_SLOTS; i++) {
+		struct svec_i2c *i2c = &svec->i2c[i];
+
+		mutex_lock(&i2c->lock);
+		if (!i2c->fmc || !i2c->present)
+			len += scnprintf(buf + len, size - len,
+					 "fmc%d: no mezzanine\n", i);
+		else if (i2c->hw)
+			len += scnprintf(buf + len, size - len,
+					 "fmc%d: hw 0x%lx %u kHz, VME write %u ns "
+					 "read %u ns\n", i, i2c->hw_base,
+					 i2c->khz, i2c->write_ns, i2c->read_ns);
+		else
+			len += scnprintf(buf + len, size - len,
+					 "fmc%d: bit-bang %u kHz, VME write %u ns "
+					 "read %u ns, delay %u ns\n", i, i2c->khz,
+					 i2c->write_ns, i2c->read_ns,
+					 i2c->delay_ns);
+		mutex_unlock(&i2c->lock);
+	}
+	return len;
+}
+
+/* Releases the EEPROM caches, when the card goes away */
+void svec_i2c_free_cache(struct svec_dev *svec)
+{
+	int i;
+
+	for (i = 0; i < SVEC_N_SLOTS; i++) {
+		kfree(svec->i2c[i].eeprom);
+		svec->i2c[i].eeprom = NULL;
+		svec->i2c[i].present = 0;
+	}
+}
@@ -8,51 +8,380 @@
 * Interrupt support code.
 */
 
+#include <linux/module.h>
 #include <linux/interrupt.h>
 #include <linux/fmc.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
 #include "vmebus.h"
 
 #include "svec.h"
+#include "svec-trace.h"
 
-/* "master" SVEC interrupt handler */
-static int svec_irq_handler(void *data)
+/*
+ * Shared IRQ mode. Both slots drive the same edge-sensitive VME interrupt, so
+ * a source asserted while the other slot is being serviced raises no new
+ * edge. Without more information, all the handlers are called on every
+ * interrupt. A mezzanine driver can register a pending-source query with
+ * svec_irq_set_pending(): its handler is then only called when the query
+ * reports work, and the queries are re-run after each pass (at most
+ * SVEC_SHARED_MAX_PASSES times) so that no source is left pending.
+ */
+#define SVEC_SHARED_MAX_PASSES	4
+
+/* VME vector dedicated to @slot, or -1 if the slot uses the card vector */
+static int svec_irq_slot_vector(struct svec_dev *svec, int slot)
+{
+	int vector = svec->cfg_cur.slot_vector[slot];
+
+	if (vector < 0 || vector == svec->cfg_cur.interrupt_vector)
+		return -1;
+	return vector;
+}
+
+static void svec_irq_shared_dispatch(struct svec_dev *svec, ktime_t stamp)
+{
+	struct svec_irq_cpu_stats *stats = this_cpu_ptr(svec->irq_stats.cpu);
+	int i, pass, called;
+
+	for (pass = 0; pass < SVEC_SHARED_MAX_PASSES; pass++) {
+		called = 0;
+
+		for (i = 0; i < SVEC_N_SLOTS; i++) {
+			irq_handler_t handler = svec->fmc_handlers[i];
+			int (*pending)(struct fmc_device *) = svec->fmc_pending[i];
+			u64 t;
+
+			/* slots with their own VME vector are not ours */
+			if (!handler || svec_irq_slot_vector(svec, i) >= 0)
+				continue;
+
+			/* without a query, we can only call it once, blindly */
+			if (!pending && pass)
+				continue;
+			if (pending && !pending(svec->fmcs[i])) {
+				if (!pass)
+					svec->irq_stats.shared_skipped[i]++;
+				continue;
+			}
+
+			svec->slot_irq[i].timestamp = stamp;
+			svec_irq_hist_add(stats->dispatch_ns, svec_irq_since(stamp));
+			t = local_clock();
+			if (handler(i, svec->fmcs[i]) == IRQ_NONE)
+				svec->irq_stats.shared_unhandled[i]++;
+			svec_irq_hist_add(stats->handler_ns, local_clock() - t);
+			svec->irq_stats.shared_calls[i]++;
+			if (pending)
+				called++;
+		}
+
+		/* re-check only if a queried source was serviced */
+		if (!called)
+			break;
+		if (pass)
+			svec->irq_stats.shared_rechecks++;
+	}
+}
+
+/*
+ * "master" SVEC interrupt handler, for one card. With @check (the vector is
+ * shared with other cards), a card with a VIC is only serviced if its RISR
+ * shows an enabled source pending; cards in shared IRQ mode can't tell and
+ * are always serviced.
+ */
+static int svec_irq_handler(struct svec_dev *svec, ktime_t stamp, u64 entry,
+			    int check)
 {
-	struct svec_dev *svec = (struct svec_dev *)data;
-	int i;
 	int rv = IRQ_HANDLED;
 	unsigned long flags;
 
-	svec->irq_count++;
+	trace_svec_irq_entry(svec, 0);
 
 	/* just in case we had an IRQ while messing around with the VIC registers/fmc_handlers */
 	spin_lock_irqsave(&svec->irq_lock, flags);
 
-	if (svec->vic)
-		rv = svec_vic_irq_dispatch(svec);
-	else {
-		/* shared irq mode: call all handlers until one of them has dealt with the interrupt */
-		for (i = 0; i < SVEC_N_SLOTS; i++) {
-			irq_handler_t handler = svec->fmc_handlers[i];
-
-			/* Call all handlers even if the current one returned IRQ_HANDLED. The SVEC
-			   VME Core IRQ is edge-sensitive, doing otherwise could result in missed irqs! */
-			if (handler) 
-				handler(i, svec->fmcs[i]);
-			
+	if (check && svec->vic) {
+		svec->irq_stats.demux_checks++;
+		if (!svec_vic_pending(svec)) {
+			spin_unlock_irqrestore(&svec->irq_lock, flags);
+			return IRQ_NONE;
 		}
+		svec->irq_stats.demux_hits++;
 	}
 
+	this_cpu_inc(svec->irq_stats.cpu->irqs);
+
+	if (svec->vic)
+		rv = svec_vic_irq_dispatch(svec, stamp, entry);
+	else
+		svec_irq_shared_dispatch(svec, stamp);
+
+	if (svec_trace_enabled(svec_irq_exit))
+		trace_svec_irq_exit(svec, local_clock() - entry);
+
 	spin_unlock_irqrestore(&svec->irq_lock, flags);
 
-	if (rv < 0) {
-		dev_warn(svec->dev, "spurious VME interrupt, ignoring\n");
+	/* counted by the dispatcher; don't let a storm flood the console */
+	if (rv == IRQ_NONE) {
+		dev_warn_ratelimited(svec->dev,
+				     "spurious VME interrupt, ignoring (%lu so far)\n",
+				     svec->irq_stats.spurious);
 		return IRQ_HANDLED;
 	}
 
 	return rv;
 }
 
+/*
+ * VME vector demultiplexer. Several cards may be configured with the same
+ * interrupt vector: the first one registers it with vme_request_irq(), the
+ * others are added to its card table. On an interrupt, the cards are checked
+ * starting from the last one which had work, since sources tend to fire in
+ * bursts, and every card with a pending source is serviced: the interrupters
+ * of the other cards have released their request on the IACK cycle, so
+ * stopping at the first one would leave their VICs waiting for an EOI.
+ */
+static LIST_HEAD(svec_vme_vectors);
+static DEFINE_MUTEX(svec_vme_vectors_lock);
+
+static int svec_irq_vector_handler(void *data)
+{
+	ktime_t stamp = ktime_get();	/* first thing: timestamp the interrupt */
+	struct svec_vme_vector *v = data;
+	u64 entry = local_clock();
+	unsigned long flags;
+	int i, n, first = -1;
+
+	spin_lock_irqsave(&v->lock, flags);
+
+	if (v->n_cards == 1) {
+		first = svec_irq_handler(v->cards[0], stamp, entry, 0);
+		spin_unlock_irqrestore(&v->lock, flags);
+		return first;
+	}
+
+	for (n = 0; n < v->n_cards; n++) {
+		i = (v->last + n) % v->n_cards;
+		if (svec_irq_handler(v->cards[i], stamp, entry, 1) == IRQ_NONE)
+			continue;
+		if (first < 0)
+			first = i;
+	}
+
+	if (first >= 0)
+		v->last = first;
+	else
+		v->spurious++;
+
+	spin_unlock_irqrestore(&v->lock, flags);
+
+	return first >= 0 ? IRQ_HANDLED : IRQ_NONE;
+}
+
+/*
+ * Per-slot VME vectors. The shared IRQ handler of a slot with a dedicated
+ * vector (slot_vector in the configuration) is registered on that vector, with
+ * its own lock, so that the two mezzanines can be serviced in parallel on
+ * different CPUs. The mezzanine gateware must raise the vector itself: its
+ * driver gets the number to program with svec_irq_vector(). The VIC is a
+ * single controller for the whole card and always uses the card vector.
+ */
+static int svec_irq_slot_handler(void *data)
+{
+	ktime_t stamp = ktime_get();
+	struct svec_slot_irq *sirq = data;
+	struct svec_dev *svec = sirq->svec;
+	struct svec_irq_cpu_stats *stats;
+	irq_handler_t handler;
+	u64 t;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sirq->lock, flags);
+
+	sirq->timestamp = stamp;
+	sirq->count++;
+
+	handler = svec->fmc_handlers[sirq->slot];
+	if (handler) {
+		stats = this_cpu_ptr(svec->irq_stats.cpu);
+		svec_irq_hist_add(stats->dispatch_ns, svec_irq_since(stamp));
+		t = local_clock();
+		if (handler(sirq->slot, svec->fmcs[sirq->slot]) == IRQ_NONE)
+			svec->irq_stats.shared_unhandled[sirq->slot]++;
+		svec_irq_hist_add(stats->handler_ns, local_clock() - t);
+		svec->irq_stats.shared_calls[sirq->slot]++;
+	}
+
+	spin_unlock_irqrestore(&sirq->lock, flags);
+
+	return IRQ_HANDLED;
+}
+
+static int svec_irq_slot_request(struct svec_dev *svec, int slot,
+				 irq_handler_t handler)
+{
+	struct svec_slot_irq *sirq = &svec->slot_irq[slot];
+	int vector = svec_irq_slot_vector(svec, slot);
+	unsigned long flags;
+	int rv;
+
+	spin_lock_irqsave(&sirq->lock, flags);
+	svec->fmc_handlers[slot] = handler;
+	spin_unlock_irqrestore(&sirq->lock, flags);
+
+	if (sirq->vector >= 0)
+		return 0;
+
+	rv = vme_request_irq(vector, svec_irq_slot_handler, sirq, svec->name);
+	if (rv) {
+		spin_lock_irqsave(&sirq->lock, flags);
+		svec->fmc_handlers[slot] = NULL;
+		spin_unlock_irqrestore(&sirq->lock, flags);
+		return rv;
+	}
+
+	sirq->vector = vector;
+	return 0;
+}
+
+static void svec_irq_slot_free(struct svec_dev *svec, int slot)
+{
+	struct svec_slot_irq *sirq = &svec->slot_irq[slot];
+	unsigned long flags;
+
+	spin_lock_irqsave(&sirq->lock, flags);
+	svec->fmc_handlers[slot] = NULL;
+	svec->fmc_pending[slot] = NULL;
+	spin_unlock_irqrestore(&sirq->lock, flags);
+
+	vme_free_irq(sirq->vector);
+	sirq->vector = -1;
+}
+
+/*
+ * Returns the VME vector the mezzanine of @fmc interrupts on in shared mode:
+ * the vector dedicated to its slot, if configured, otherwise the card's.
+ */
+int svec_irq_vector(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
+	int vector = svec_irq_slot_vector(svec, fmc->slot_id);
+
+	return vector >= 0 ? vector : svec->cfg_cur.interrupt_vector;
+}
+EXPORT_SYMBOL(svec_irq_vector);
+
+/* registers the card on its VME vector the first time somebody requests an interrupt */
+static int svec_irq_master_request(struct svec_dev *svec)
+{
+	int vector = svec->cfg_cur.interrupt_vector;
+	struct svec_vme_vector *v;
+	unsigned long flags;
+	int rv = 0;
+
+	if (test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags))
+		return 0;
+
+	mutex_lock(&svec_vme_vectors_lock);
+
+	list_for_each_entry(v, &svec_vme_vectors, list) {
+		if (v->vector != vector)
+			continue;
+
+		spin_lock_irqsave(&v->lock, flags);
+		v->cards[v->n_cards++] = svec;
+		spin_unlock_irqrestore(&v->lock, flags);
+		goto done;
+	}
+
+	v = kzalloc(sizeof(*v), GFP_KERNEL);
+	if (!v) {
+		rv = -ENOMEM;
+		goto out;
+	}
+	v->vector = vector;
+	spin_lock_init(&v->lock);
+	v->cards[v->n_cards++] = svec;
+
+	rv = vme_request_irq(vector, svec_irq_vector_handler, v, KBUILD_MODNAME);
+	if (rv) {
+		kfree(v);
+		goto out;
+	}
+	list_add(&v->list, &svec_vme_vectors);
+
+      done:
+	svec->vme_vector = v;
+	svec->current_vector = vector;
+	set_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags);
+      out:
+	mutex_unlock(&svec_vme_vectors_lock);
+	return rv;
+}
+
+/* Demultiplexer statistics, for debugfs */
+void svec_irq_show_vector(struct svec_dev *svec, struct seq_file *m)
+{
+	struct svec_vme_vector *v;
+
+	mutex_lock(&svec_vme_vectors_lock);
+	v = svec->vme_vector;
+	if (v)
+		seq_printf(m, "vector 0x%02x: %d card(s), checks %lu hits %lu, "
+			   "spurious for all cards %lu\n", v->vector, v->n_cards,
+			   svec->irq_stats.demux_checks,
+			   svec->irq_stats.demux_hits, v->spurious);
+	mutex_unlock(&svec_vme_vectors_lock);
+}
+
+/*
+ * VME interrupts of the card, summed over the CPUs. It replaces the irq_count
+ * field of struct svec_dev, which mezzanine drivers used to read.
+ */
+unsigned long svec_irq_count(struct svec_dev *svec)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(svec->irq_stats.cpu, cpu)->irqs;
+	return count;
+}
+EXPORT_SYMBOL(svec_irq_count);
+
+/* removes the card from its VME vector, freeing the vector with the last card */
+static void svec_irq_master_free(struct svec_dev *svec)
+{
+	struct svec_vme_vector *v = svec->vme_vector;
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&svec_vme_vectors_lock);
+
+	spin_lock_irqsave(&v->lock, flags);
+	for (i = 0; i < v->n_cards; i++)
+		if (v->cards[i] == svec)
+			v->cards[i] = v->cards[--v->n_cards];
+	v->last = 0;
+	spin_unlock_irqrestore(&v->lock, flags);
+
+	if (!v->n_cards) {
+		vme_free_irq(v->vector);
+		list_del(&v->list);
+		kfree(v);
+	}
+
+	mutex_unlock(&svec_vme_vectors_lock);
+
+	svec->vme_vector = NULL;
+	clear_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags);
+}
+
 int svec_irq_request(struct fmc_device *fmc, irq_handler_t handler,
 		     char *name, int flags)
 {
@@ -61,7 +390,10 @@ int svec_irq_request(struct fmc_device *fmc, irq_handler_t handler,
 
 	/* Depending on IRQF_SHARED flag, choose between a VIC and shared IRQ mode */
 	if (!flags)
-		rv = svec_vic_irq_request(svec, fmc, fmc->irq, handler);
+		rv = svec_vic_irq_request(svec, fmc, fmc->irq, handler, name);
+	else if ((flags & IRQF_SHARED) &&
+		 svec_irq_slot_vector(svec, fmc->slot_id) >= 0)
+		return svec_irq_slot_request(svec, fmc->slot_id, handler);
 	else if (flags & IRQF_SHARED) {
 		spin_lock(&svec->irq_lock);
 		svec->fmc_handlers[fmc->slot_id] = handler;
@@ -69,20 +401,121 @@ int svec_irq_request(struct fmc_device *fmc, irq_handler_t handler,
 	} else
 		return -EINVAL;
 
-	/* register the master VME handler the first time somebody requests an interrupt */
-	if (!rv && !test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags)) {
+	if (!rv)
+		rv = svec_irq_master_request(svec);
+
+	return rv;
+}
+
+/*
+ * Returns the Linux IRQ number of the VIC vector whose ID (the SDB address of
+ * the interrupting core) is @id. Mezzanine drivers can then use request_irq(),
+ * irq affinity and threaded handlers (with IRQF_ONESHOT) directly, instead of
+ * fmc->op->irq_request(). They must be freed before the card is reconfigured.
+ */
+int svec_irq_find_mapping(struct fmc_device *fmc, unsigned long id)
+{
+	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
+	int irq, rv;
+
+	irq = svec_vic_irq_map(svec, fmc, id);
+	if (irq < 0)
+		return irq;
+
+	rv = svec_irq_master_request(svec);
+	if (rv)
+		return rv;
+
+	return irq;
+}
+EXPORT_SYMBOL(svec_irq_find_mapping);
 
-		rv = vme_request_irq(svec->cfg_cur.interrupt_vector,
-				     svec_irq_handler, (void *)svec,
-				     svec->name);
-		svec->current_vector = svec->cfg_cur.interrupt_vector;
+/*
+ * The same, for userspace (see svec-cdev.c): the VIC is looked up under
+ * irq_lock if it is up already, and otherwise set up through an fmc device
+ * that still holds its SDB tree (the mezzanine driver may have freed it).
+ */
+int svec_irq_find_card_mapping(struct svec_dev *svec, unsigned long id)
+{
+	int i, irq, rv;
 
-		if (!rv)
-			set_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags);
+	irq = svec_vic_irq_lookup(svec, id);
+	if (irq == -ENODEV) {
+		if (!test_bit(SVEC_FLAG_FMCS_REGISTERED, &svec->flags))
+			return -ENODEV;
+		for (i = 0; i < svec->fmcs_n; i++)
+			if (svec->fmcs[i] && svec->fmcs[i]->sdb)
+				return svec_irq_find_mapping(svec->fmcs[i], id);
+		return -ENODEV;
 	}
+	if (irq < 0)
+		return irq;
 
-	return rv;
+	rv = svec_irq_master_request(svec);
+	if (rv)
+		return rv;
+
+	return irq;
+}
+
+/*
+ * Called when userspace lets a vector go: like svec_irq_free() in shared
+ * mode, gives the card's VME vector back once nobody uses it anymore, no
+ * VIC vector being requested and no shared handler registered.
+ */
+void svec_irq_put_card_mapping(struct svec_dev *svec)
+{
+	if (!test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags))
+		return;
+	if (svec->fmc_handlers[0] || svec->fmc_handlers[1] ||
+	    svec_vic_requested(svec))
+		return;
+	svec_irq_master_free(svec);
+}
+
+/*
+ * Returns the time at which the VME interrupt being serviced reached the
+ * driver, captured before any VME access. Timing mezzanines should call it from
+ * their handler rather than reading the clock. The time is kept per VIC vector
+ * (the one of fmc->irq, see svec_irq_vector_timestamp() for the others) or per
+ * slot in shared mode, and is valid from the handler until the next interrupt
+ * of that vector or slot; with IRQF_ONESHOT, the vector stays masked and the
+ * time valid until the threaded handler returns.
+ */
+ktime_t svec_irq_timestamp(struct fmc_device *fmc)
+{
+	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
+
+	if (svec_irq_slot_vector(svec, fmc->slot_id) < 0 && svec->vic)
+		return svec_vic_timestamp(svec, fmc->irq);
+	return svec->slot_irq[fmc->slot_id].timestamp;
+}
+EXPORT_SYMBOL(svec_irq_timestamp);
+
+/* The same, for the VIC vector whose ID is @id (see svec_irq_find_mapping()) */
+ktime_t svec_irq_vector_timestamp(struct fmc_device *fmc, unsigned long id)
+{
+	return svec_vic_timestamp(fmc->carrier_data, id);
 }
+EXPORT_SYMBOL(svec_irq_vector_timestamp);
+
+/*
+ * Registers a pending-source query for the shared IRQ mode: @pending returns
+ * non-zero when the mezzanine of @fmc has an interrupt to service, typically
+ * from a status register of its gateware. Its handler is then skipped on the
+ * interrupts of the other slot. Pass NULL to go back to unconditional calls.
+ */
+void svec_irq_set_pending(struct fmc_device *fmc,
+			  int (*pending)(struct fmc_device *fmc))
+{
+	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	svec->fmc_pending[fmc->slot_id] = pending;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+}
+EXPORT_SYMBOL(svec_irq_set_pending);
 
 void svec_irq_ack(struct fmc_device *fmc)
 {
@@ -94,7 +527,11 @@ void svec_irq_ack(struct fmc_device *fmc)
 int svec_irq_free(struct fmc_device *fmc)
 {
 	struct svec_dev *svec = (struct svec_dev *)fmc->carrier_data;
-	int rv;
+
+	if (svec->slot_irq[fmc->slot_id].vector >= 0) {
+		svec_irq_slot_free(svec, fmc->slot_id);
+		return 0;
+	}
 
 	/* freeing a nonexistent interrupt? */
 	if (!test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags))
@@ -105,16 +542,12 @@ int svec_irq_free(struct fmc_device *fmc)
 
 	spin_lock(&svec->irq_lock);
 	svec->fmc_handlers[fmc->slot_id] = NULL;
+	svec->fmc_pending[fmc->slot_id] = NULL;
 	spin_unlock(&svec->irq_lock);
 
 	/* shared IRQ mode: disable VME interrupt when freeing last FMC handler */
-	if (!svec->vic && !svec->fmc_handlers[0] && !svec->fmc_handlers[1]) {
-		rv = vme_free_irq(svec->current_vector);
-		if (rv < 0)
-			return rv;
-
-		clear_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags);
-	}
+	if (!svec->vic && !svec->fmc_handlers[0] && !svec->fmc_handlers[1])
+		svec_irq_master_free(svec);
 
 	return 0;
 }
@@ -122,11 +555,20 @@ int svec_irq_free(struct fmc_device *fmc)
 /* cleanup function, disables VME master interrupt when the driver is unloaded */
 void svec_irq_exit(struct svec_dev *svec)
 {
-	if (!test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags))
-		return;
+	int i;
+
+	for (i = 0; i < SVEC_N_SLOTS; i++)
+		if (svec->slot_irq[i].vector >= 0)
+			svec_irq_slot_free(svec, i);
+
+	if (test_bit(SVEC_FLAG_IRQS_REQUESTED, &svec->flags))
+		svec_irq_master_free(svec);
 
-	vme_free_irq(svec->current_vector);
 	memset(svec->fmc_handlers, 0, sizeof(svec->fmc_handlers));
+	memset(svec->fmc_pending, 0, sizeof(svec->fmc_pending));
+
+	/* vectors handed to userspace go away with the VIC */
+	svec_cdev_irq_exit(svec);
 
 	if (svec->vic)
 		svec_vic_cleanup(svec);
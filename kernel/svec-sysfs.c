@@ -197,6 +197,46 @@ ATTR_STORE_CALLBACK(interrupt_vector)
 	return count;
 }
 
+static ssize_t svec_show_slot_vector(struct svec_dev *card, int slot,
+				     char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", card->cfg_cur.slot_vector[slot]);
+}
+
+static ssize_t svec_store_slot_vector(struct svec_dev *card, int slot,
+				      const char *buf, size_t count)
+{
+	int vec;
+
+	if (sscanf(buf, "%i", &vec) != 1)
+		return -EINVAL;
+	if (vec < -1 || vec > 255)
+		return -EINVAL;
+
+	card->cfg_new.slot_vector[slot] = vec;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(interrupt_vector_fmc0)
+{
+	return svec_show_slot_vector(dev_get_drvdata(pdev), 0, buf);
+}
+
+ATTR_STORE_CALLBACK(interrupt_vector_fmc0)
+{
+	return svec_store_slot_vector(dev_get_drvdata(pdev), 0, buf, count);
+}
+
+ATTR_SHOW_CALLBACK(interrupt_vector_fmc1)
+{
+	return svec_show_slot_vector(dev_get_drvdata(pdev), 1, buf);
+}
+
+ATTR_STORE_CALLBACK(interrupt_vector_fmc1)
+{
+	return svec_store_slot_vector(dev_get_drvdata(pdev), 1, buf, count);
+}
+
 ATTR_SHOW_CALLBACK(vme_am)
 {
 	struct svec_dev *card = dev_get_drvdata(pdev);
@@ -409,6 +449,206 @@ ATTR_STORE_CALLBACK(configured)
 	return count;
 }
 
+ATTR_SHOW_CALLBACK(irq_poll_threshold)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", card->irq_poll_threshold);
+}
+
+ATTR_STORE_CALLBACK(irq_poll_threshold)
+{
+	unsigned int rate;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &rate) != 1)
+		return -EINVAL;
+
+	card->irq_poll_threshold = rate;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(irq_poll_period_us)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", card->irq_poll_period_us);
+}
+
+ATTR_STORE_CALLBACK(irq_poll_period_us)
+{
+	unsigned int period;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &period) != 1)
+		return -EINVAL;
+	if (period < 1 || period > USEC_PER_SEC)
+		return -EINVAL;
+
+	card->irq_poll_period_us = period;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(vic_vectors)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return svec_vic_show_vectors(card, buf, PAGE_SIZE);
+}
+
+ATTR_SHOW_CALLBACK(i2c_status)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return svec_i2c_show_status(card, buf, PAGE_SIZE);
+}
+
+ATTR_SHOW_CALLBACK(sdb_devices)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return svec_sdb_show_devices(card, buf, PAGE_SIZE);
+}
+
+ATTR_SHOW_CALLBACK(vic_retry_us)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			card->vic_retry_len / SVEC_VIC_TICKS_PER_US);
+}
+
+ATTR_STORE_CALLBACK(vic_retry_us)
+{
+	unsigned int us;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &us) != 1)
+		return -EINVAL;
+	if (us < 1 || us * SVEC_VIC_TICKS_PER_US > SVEC_VIC_MAX_RETRY_LEN)
+		return -EINVAL;
+
+	svec_vic_set_retry(card, us * SVEC_VIC_TICKS_PER_US);
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(vic_retry_autotune)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%d\n", card->vic_retry_autotune);
+}
+
+ATTR_STORE_CALLBACK(vic_retry_autotune)
+{
+	int enabled;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%i", &enabled) != 1)
+		return -EINVAL;
+
+	if (enabled != 0 && enabled != 1)
+		return -EINVAL;
+
+	card->vic_retry_autotune = enabled;
+	if (enabled)
+		schedule_delayed_work(&card->vic_tune_work, HZ);
+	else
+		cancel_delayed_work_sync(&card->vic_tune_work);
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(irq_storm_threshold)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", card->irq_storm_threshold);
+}
+
+ATTR_STORE_CALLBACK(irq_storm_threshold)
+{
+	unsigned int rate;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &rate) != 1)
+		return -EINVAL;
+
+	card->irq_storm_threshold = rate;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(irq_spurious)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%lu\n", card->irq_stats.spurious);
+}
+
+ATTR_SHOW_CALLBACK(irq_storms)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%lu\n", card->irq_stats.vic_storms);
+}
+
+ATTR_SHOW_CALLBACK(irq_busy_poll_cpu)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%d\n", card->irq_busy_poll_cpu);
+}
+
+ATTR_STORE_CALLBACK(irq_busy_poll_cpu)
+{
+	int cpu, error;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%i", &cpu) != 1)
+		return -EINVAL;
+
+	error = svec_vic_busy_poll(card, cpu < 0 ? -1 : cpu);
+	if (error)
+		return error;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(irq_busy_poll_ns)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", card->irq_busy_poll_ns);
+}
+
+ATTR_STORE_CALLBACK(irq_busy_poll_ns)
+{
+	unsigned int ns;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &ns) != 1)
+		return -EINVAL;
+	if (ns > SVEC_MAX_BUSY_POLL_NS)
+		return -EINVAL;
+
+	card->irq_busy_poll_ns = ns;
+	return count;
+}
+
+ATTR_SHOW_CALLBACK(irq_busy_poll_idle_us)
+{
+	struct svec_dev *card = dev_get_drvdata(pdev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", card->irq_busy_poll_idle_us);
+}
+
+ATTR_STORE_CALLBACK(irq_busy_poll_idle_us)
+{
+	unsigned int us;
+
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	if (sscanf(buf, "%u", &us) != 1)
+		return -EINVAL;
+	if (us > USEC_PER_SEC)
+		return -EINVAL;
+
+	card->irq_busy_poll_idle_us = us;
+	return count;
+}
+
 ATTR_SHOW_CALLBACK(slot)
 {
 	struct svec_dev *card = dev_get_drvdata(pdev);
@@ -437,6 +677,16 @@ static DEVICE_ATTR(interrupt_vector,
 		   S_IWUSR | S_IRUGO,
 		   svec_show_interrupt_vector, svec_store_interrupt_vector);
 
+/* Optional VME vectors dedicated to each FMC slot, for shared-mode interrupts
+  raised by the mezzanine gateware itself. -1 means the card's vector. */
+static DEVICE_ATTR(interrupt_vector_fmc0,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_interrupt_vector_fmc0, svec_store_interrupt_vector_fmc0);
+
+static DEVICE_ATTR(interrupt_vector_fmc1,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_interrupt_vector_fmc1, svec_store_interrupt_vector_fmc1);
+
 static DEVICE_ATTR(interrupt_level,
 		   S_IWUSR | S_IRUGO,
 		   svec_show_interrupt_level, svec_store_interrupt_level);
@@ -479,6 +729,80 @@ static DEVICE_ATTR(configured,
 		   S_IWUSR | S_IRUGO,
 		   svec_show_configured, svec_store_configured);
 
+/*
+  Adaptive interrupt polling: VIC vectors firing faster than irq_poll_threshold
+  interrupts per second (0 disables it) are masked and polled every
+  irq_poll_period_us until the load drops. vic_vectors lists the vectors in
+  use, with their mode and rate.
+*/
+static DEVICE_ATTR(irq_poll_threshold,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_poll_threshold, svec_store_irq_poll_threshold);
+
+static DEVICE_ATTR(irq_poll_period_us,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_poll_period_us, svec_store_irq_poll_period_us);
+
+static DEVICE_ATTR(vic_vectors, S_IRUGO, svec_show_vic_vectors, NULL);
+
+/*
+  VIC edge emulation retry timer, i.e. the delay after which a source still
+  pending after an EOI is signalled again. vic_retry_autotune adjusts it once
+  per second from the handler service time and the spurious interrupt rate.
+*/
+static DEVICE_ATTR(vic_retry_us,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_vic_retry_us, svec_store_vic_retry_us);
+
+static DEVICE_ATTR(vic_retry_autotune,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_vic_retry_autotune, svec_store_vic_retry_autotune);
+
+/*
+  Spurious interrupts and storms: irq_spurious counts the VME interrupts for
+  which no VIC vector was pending. A vector whose handler returns IRQ_NONE
+  more than irq_storm_threshold times per second (0 disables it) is masked for
+  a while, with exponential backoff; irq_storms counts these events.
+*/
+static DEVICE_ATTR(irq_storm_threshold,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_storm_threshold, svec_store_irq_storm_threshold);
+
+static DEVICE_ATTR(irq_spurious, S_IRUGO, svec_show_irq_spurious, NULL);
+
+static DEVICE_ATTR(irq_storms, S_IRUGO, svec_show_irq_storms, NULL);
+
+/*
+  Busy-poll mode: writing a CPU number to irq_busy_poll_cpu starts a thread
+  bound to it, which polls the VIC every irq_busy_poll_ns (0: continuously) and
+  dispatches the handlers directly; -1 stops it. When idle, the thread backs
+  off to sleeps of up to irq_busy_poll_idle_us (0: never sleep).
+*/
+static DEVICE_ATTR(irq_busy_poll_cpu,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_busy_poll_cpu, svec_store_irq_busy_poll_cpu);
+
+static DEVICE_ATTR(irq_busy_poll_ns,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_busy_poll_ns, svec_store_irq_busy_poll_ns);
+
+static DEVICE_ATTR(irq_busy_poll_idle_us,
+		   S_IWUSR | S_IRUGO,
+		   svec_show_irq_busy_poll_idle_us,
+		   svec_store_irq_busy_poll_idle_us);
+
+/*
+  Mezzanine I2C buses: the bit rate of each slot, and the VME timing it
+  was calibrated from
+*/
+static DEVICE_ATTR(i2c_status, S_IRUGO, svec_show_i2c_status, NULL);
+
+/*
+  SDB records of the running gateware, read once per bitstream: sdb_devices
+  lists vendor, device, first and last address and name of each device
+*/
+static DEVICE_ATTR(sdb_devices, S_IRUGO, svec_show_sdb_devices, NULL);
+
 /*
   Raw VME read/write access, for debugging purposes
 */
@@ -493,6 +817,8 @@ static struct attribute *svec_attrs[] = {
 	&dev_attr_firmware_blob.attr,
 	&dev_attr_firmware_cmd.attr,
 	&dev_attr_interrupt_vector.attr,
+	&dev_attr_interrupt_vector_fmc0.attr,
+	&dev_attr_interrupt_vector_fmc1.attr,
 	&dev_attr_interrupt_level.attr,
 	&dev_attr_vme_base.attr,
 	&dev_attr_vme_size.attr,
@@ -503,6 +829,19 @@ static struct attribute *svec_attrs[] = {
 	&dev_attr_vme_addr.attr,
 	&dev_attr_vme_data.attr,
 	&dev_attr_slot.attr,
+	&dev_attr_irq_poll_threshold.attr,
+	&dev_attr_irq_poll_period_us.attr,
+	&dev_attr_vic_vectors.attr,
+	&dev_attr_vic_retry_us.attr,
+	&dev_attr_vic_retry_autotune.attr,
+	&dev_attr_irq_storm_threshold.attr,
+	&dev_attr_irq_spurious.attr,
+	&dev_attr_irq_storms.attr,
+	&dev_attr_irq_busy_poll_cpu.attr,
+	&dev_attr_irq_busy_poll_ns.attr,
+	&dev_attr_irq_busy_poll_idle_us.attr,
+	&dev_attr_i2c_status.attr,
+	&dev_attr_sdb_devices.attr,
 	NULL,
 };
 
@@ -510,20 +849,104 @@ static struct attribute_group svec_attr_group = {
 	.attrs = svec_attrs,
 };
 
+/*
+  FRU EEPROM of each mezzanine, read and written at any offset through the
+  driver's image of it: writes only touch the bytes which change
+*/
+static ssize_t svec_read_fmc_eeprom(struct file *file, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct device *pdev = container_of(kobj, struct device, kobj);
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	return svec_eeprom_slot_read(card, (long)attr->private, off, buf,
+				     count);
+}
+
+static ssize_t svec_write_fmc_eeprom(struct file *file, struct kobject *kobj,
+				     struct bin_attribute *attr, char *buf,
+				     loff_t off, size_t count)
+{
+	struct device *pdev = container_of(kobj, struct device, kobj);
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	return svec_eeprom_slot_write(card, (long)attr->private, off, buf,
+				      count);
+}
+
+/*
+  The raw SDB records behind sdb_devices, with absolute addresses
+*/
+static ssize_t svec_read_sdb(struct file *file, struct kobject *kobj,
+			     struct bin_attribute *attr, char *buf,
+			     loff_t off, size_t count)
+{
+	struct device *pdev = container_of(kobj, struct device, kobj);
+	struct svec_dev *card = dev_get_drvdata(pdev);
+
+	return svec_sdb_read_blob(card, buf, off, count);
+}
+
+static struct bin_attribute svec_sdb_attr = {
+	.attr = {.name = "sdb", .mode = S_IRUGO},
+	.size = 0,		/* depends on the gateware */
+	.read = svec_read_sdb,
+};
+
+static struct bin_attribute svec_fmc_eeprom_attrs[SVEC_N_SLOTS] = {
+	[0] = {
+		.attr = {.name = "fmc0_eeprom", .mode = S_IWUSR | S_IRUGO},
+		.size = SVEC_I2C_EEPROM_SIZE,
+		.read = svec_read_fmc_eeprom,
+		.write = svec_write_fmc_eeprom,
+		.private = (void *)0,
+	},
+	[1] = {
+		.attr = {.name = "fmc1_eeprom", .mode = S_IWUSR | S_IRUGO},
+		.size = SVEC_I2C_EEPROM_SIZE,
+		.read = svec_read_fmc_eeprom,
+		.write = svec_write_fmc_eeprom,
+		.private = (void *)1,
+	},
+};
+
 /******************** sysfs file management ***************************/
 int svec_create_sysfs_files(struct svec_dev *card)
 {
 	int error = 0;
+	int i;
 
 	error = sysfs_create_group(&card->dev->kobj, &svec_attr_group);
 
 	if (error)
 		return error;
 
+	for (i = 0; i < SVEC_N_SLOTS; i++) {
+		error = sysfs_create_bin_file(&card->dev->kobj,
+					      &svec_fmc_eeprom_attrs[i]);
+		if (error)
+			break;
+	}
+	if (!error)
+		error = sysfs_create_bin_file(&card->dev->kobj, &svec_sdb_attr);
+	if (error) {
+		while (--i >= 0)
+			sysfs_remove_bin_file(&card->dev->kobj,
+					      &svec_fmc_eeprom_attrs[i]);
+		sysfs_remove_group(&card->dev->kobj, &svec_attr_group);
+	}
+
 	return error;
 }
 
 void svec_remove_sysfs_files(struct svec_dev *card)
 {
+	int i;
+
+	sysfs_remove_bin_file(&card->dev->kobj, &svec_sdb_attr);
+	for (i = 0; i < SVEC_N_SLOTS; i++)
+		sysfs_remove_bin_file(&card->dev->kobj,
+				      &svec_fmc_eeprom_attrs[i]);
 	sysfs_remove_group(&card->dev->kobj, &svec_attr_group);
 }
@@ -0,0 +1,196 @@
+/*
+* Copyright (C) 2014 CERN (www.cern.ch)
+*
+* Released according to the GNU GPL, version 2 or any later version
+*
+* Driver for SVEC (Simple VME FMC carrier) board.
+* Tracepoints, for perf and trace-cmd ("svec" trace system). Every event
+* carries the card's lun, VME slot and interrupt vector, and a duration in
+* ns (0 for the events marking the start of something).
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM svec
+
+#if !defined(__SVEC_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __SVEC_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#include "svec.h"
+
+/*
+ * Durations are measured only when the event is on: the callers test
+ * svec_trace_enabled() first. trace_<event>_enabled() came with 4.5, and
+ * tests the static key of the tracepoint, which older kernels have too.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+#define svec_trace_enabled(event) static_key_false(&__tracepoint_##event.key)
+#else
+#define svec_trace_enabled(event) trace_##event##_enabled()
+#endif
+
+#define SVEC_TRACE_CARD_ENTRY \
+	__field(int, lun) \
+	__field(int, slot) \
+	__field(int, vector) \
+	__field(u64, ns)
+
+#define SVEC_TRACE_CARD_ASSIGN(svec, duration) \
+	__entry->lun = (svec)->lun; \
+	__entry->slot = (svec)->slot; \
+	__entry->vector = (svec)->cfg_cur.interrupt_vector; \
+	__entry->ns = (duration);
+
+#define SVEC_TRACE_CARD_FMT "lun %d slot %d vector 0x%02x ns %llu"
+
+#define SVEC_TRACE_CARD_ARGS \
+	__entry->lun, __entry->slot, __entry->vector, \
+	(unsigned long long)__entry->ns
+
+DECLARE_EVENT_CLASS(svec_card,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, ns)
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT, SVEC_TRACE_CARD_ARGS)
+);
+
+/* VME interrupt of the card: entry, and exit with the time spent */
+DEFINE_EVENT(svec_card, svec_irq_entry,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns));
+
+DEFINE_EVENT(svec_card, svec_irq_exit,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns));
+
+/* Bitstream loading: FIFO drained and DONE, timed from the start */
+DEFINE_EVENT(svec_card, svec_load_fpga_drained,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns));
+
+DEFINE_EVENT(svec_card, svec_load_fpga_done,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns));
+
+/* VME64x core CSR setup */
+DEFINE_EVENT(svec_card, svec_csr_setup,
+	TP_PROTO(struct svec_dev *svec, u64 ns),
+	TP_ARGS(svec, ns));
+
+TRACE_EVENT(svec_load_fpga_start,
+	TP_PROTO(struct svec_dev *svec, int size),
+	TP_ARGS(svec, size),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+		__field(int, size)
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, 0)
+		__entry->size = size;
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT " size %d", SVEC_TRACE_CARD_ARGS,
+		  __entry->size)
+);
+
+/* VIC vector dispatch and EOI (ns: since the entry of the VME interrupt
+   handler, or the poll which found the vector pending) */
+DECLARE_EVENT_CLASS(svec_vic,
+	TP_PROTO(struct svec_dev *svec, int index, u32 id, u64 ns),
+	TP_ARGS(svec, index, id, ns),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+		__field(int, index)
+		__field(u32, id)
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, ns)
+		__entry->index = index;
+		__entry->id = id;
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT " vic %d id 0x%08x",
+		  SVEC_TRACE_CARD_ARGS, __entry->index, __entry->id)
+);
+
+DEFINE_EVENT(svec_vic, svec_vic_dispatch,
+	TP_PROTO(struct svec_dev *svec, int index, u32 id, u64 ns),
+	TP_ARGS(svec, index, id, ns));
+
+DEFINE_EVENT(svec_vic, svec_vic_eoi,
+	TP_PROTO(struct svec_dev *svec, int index, u32 id, u64 ns),
+	TP_ARGS(svec, index, id, ns));
+
+/* One phase of svec_reconfigure() */
+TRACE_EVENT(svec_reconfigure_phase,
+	TP_PROTO(struct svec_dev *svec, const char *phase, u64 ns),
+	TP_ARGS(svec, phase, ns),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+		__string(phase, phase)
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, ns)
+		__assign_str(phase, phase);
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT " %s", SVEC_TRACE_CARD_ARGS,
+		  __get_str(phase))
+);
+
+TRACE_EVENT(svec_eeprom_xfer,
+	TP_PROTO(struct svec_dev *svec, int fmc_slot, u32 offset, size_t size,
+		 u64 ns),
+	TP_ARGS(svec, fmc_slot, offset, size, ns),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+		__field(int, fmc_slot)
+		__field(u32, offset)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, ns)
+		__entry->fmc_slot = fmc_slot;
+		__entry->offset = offset;
+		__entry->size = size;
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT " fmc %d offset 0x%x size %zu",
+		  SVEC_TRACE_CARD_ARGS, __entry->fmc_slot, __entry->offset,
+		  __entry->size)
+);
+
+/* VME window mapping and unmapping */
+DECLARE_EVENT_CLASS(svec_window,
+	TP_PROTO(struct svec_dev *svec, int window, u64 ns),
+	TP_ARGS(svec, window, ns),
+	TP_STRUCT__entry(
+		SVEC_TRACE_CARD_ENTRY
+		__field(int, window)
+	),
+	TP_fast_assign(
+		SVEC_TRACE_CARD_ASSIGN(svec, ns)
+		__entry->window = window;
+	),
+	TP_printk(SVEC_TRACE_CARD_FMT " window %s", SVEC_TRACE_CARD_ARGS,
+		  __entry->window == MAP_REG ? "register" : "CR/CSR")
+);
+
+DEFINE_EVENT(svec_window, svec_window_map,
+	TP_PROTO(struct svec_dev *svec, int window, u64 ns),
+	TP_ARGS(svec, window, ns));
+
+DEFINE_EVENT(svec_window, svec_window_unmap,
+	TP_PROTO(struct svec_dev *svec, int window, u64 ns),
+	TP_ARGS(svec, window, ns));
+
+#endif /* __SVEC_TRACE_H__ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE svec-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,33 @@
+/*
+* Copyright (C) 2014 CERN (www.cern.ch)
+*
+* Released according to the GNU GPL, version 2 or any later version
+*
+* Driver for SVEC (Simple VME FMC carrier) board.
+* Definitions shared with user space (the /dev/svec.<lun> device).
+*/
+#ifndef __SVEC_USER_H__
+#define __SVEC_USER_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Userspace interrupt delivery: each open file of /dev/svec.<lun> can bind one
+ * VIC vector, identified like in the kernel by the SDB address of the
+ * interrupting core. The vector is masked when it fires; read() (blocking,
+ * or after poll()) returns the total number of interrupts as a __u32, and the
+ * optional eventfd is signalled. Writing the __u32 value 1 (or the ACK ioctl)
+ * re-enables the vector once the source has been serviced.
+ */
+struct svec_irq_request {
+	__u32 id;		/* SDB address of the interrupting core */
+	__s32 eventfd;		/* eventfd to signal, or -1 */
+};
+
+#define SVEC_IOC_MAGIC		'S'
+
+#define SVEC_IOCTL_IRQ_REQUEST	_IOW(SVEC_IOC_MAGIC, 1, struct svec_irq_request)
+#define SVEC_IOCTL_IRQ_ACK	_IO(SVEC_IOC_MAGIC, 2)
+
+#endif /* __SVEC_USER_H__ */
@@ -9,11 +9,25 @@
 */
 
 #include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
 #include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/irq_work.h>
+#include <linux/delay.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <asm/div64.h>
 #include <linux/fmc.h>
 #include <linux/fmc-sdb.h>
 
 #include "svec.h"
+#include "svec-trace.h"
 
 #include "hw/vic_regs.h"
 
@@ -22,14 +36,39 @@
 #define VIC_SDB_VENDOR 0xce42
 #define VIC_SDB_DEVICE 0x0013
 
+/* Interrupt rate measurement window, for the adaptive polling mode */
+#define VIC_RATE_WINDOW (HZ / 100 ? HZ / 100 : 1)
+/* Maximum number of RISR passes per poll, to bound the time spent in a poll */
+#define VIC_POLL_BUDGET 8
+
 /* A Vectored Interrupt Controller object */
 struct vic_irq_controller {
 	/* already-initialized flag */
 	int initialized;
+	/* Hash of the gateware the controller was found in */
+	uint32_t fw_hash;
 	/* Base address (FPGA-relative) */
 	uint32_t base;
 	/* Mapped base address of the VIC */
 	void *kernel_va;
+	/* Linux IRQ domain translating vector indices into IRQ numbers */
+	struct irq_domain *domain;
+	/* Software copy of the Interrupt Mask Register */
+	unsigned long enabled;
+	/* Vectors currently serviced by polling instead of interrupts */
+	uint32_t poll_mask;
+	int polling;
+	struct hrtimer poll_timer;
+	/* Vectors muted by the interrupt storm detector, until their backoff expires */
+	uint32_t storm_mask;
+	/* Protects the three masks above and the IER/IDR writes which follow
+	   them. The irq_chip callbacks can't take svec->irq_lock: the dispatcher
+	   holds it when the flow handler masks a vector. Nests inside it. */
+	raw_spinlock_t mask_lock;
+	struct delayed_work storm_work;
+	struct svec_dev *svec;
+	/* On vic_orphans while vectors are still requested, see svec_vic_release() */
+	struct list_head orphan;
 
 	/* Vector table */
 	struct vector {
@@ -39,6 +78,23 @@ struct vic_irq_controller {
 		irq_handler_t handler;
 		/* FMC device that owns the interrupt */
 		struct fmc_device *requestor;
+		/* Linux IRQ number mapped to the vector */
+		unsigned int irq;
+		/* Rate estimation: events in the current window, and last rate (per s) */
+		unsigned long window_start;
+		unsigned int window_count;
+		unsigned int rate;
+		/* Statistics: events dispatched, and of those not handled */
+		unsigned long count;
+		unsigned long unhandled;
+		/* Storm detection: unhandled events in the current window, backoff */
+		unsigned long storm_window;
+		unsigned int storm_count;
+		unsigned long storm_backoff;
+		unsigned long storm_until;
+		unsigned long storms;
+		/* Arrival of the interrupt it was last dispatched for */
+		ktime_t stamp;
 	} vectors[VIC_MAX_VECTORS];
 };
 
@@ -54,11 +110,710 @@ static inline uint32_t vic_readl(struct vic_irq_controller *vic,
 	return ioread32be(vic->kernel_va + offset);
 }
 
+/* Vectors serviced by interrupts: enabled, neither polled nor muted by the
+   storm detector */
+static inline uint32_t vic_irq_sources(struct vic_irq_controller *vic)
+{
+	return vic->enabled & ~(vic->poll_mask | vic->storm_mask);
+}
+
+/*
+ * irq_chip operations: mask/unmask/eoi map directly onto the VIC registers.
+ * kernel_va is NULL once the card has let the controller go: a late
+ * free_irq() must not touch a window which may be gone.
+ */
+static void vic_irq_mask(struct irq_data *d)
+{
+	struct vic_irq_controller *vic = irq_data_get_irq_chip_data(d);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&vic->mask_lock, flags);
+	clear_bit(d->hwirq, &vic->enabled);
+	if (vic->kernel_va)
+		vic_writel(vic, 1 << d->hwirq, VIC_REG_IDR);
+	raw_spin_unlock_irqrestore(&vic->mask_lock, flags);
+}
+
+static void vic_irq_unmask(struct irq_data *d)
+{
+	struct vic_irq_controller *vic = irq_data_get_irq_chip_data(d);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&vic->mask_lock, flags);
+	set_bit(d->hwirq, &vic->enabled);
+	if (vic->kernel_va && (vic_irq_sources(vic) & (1 << d->hwirq)))
+		vic_writel(vic, 1 << d->hwirq, VIC_REG_IER);
+	raw_spin_unlock_irqrestore(&vic->mask_lock, flags);
+}
+
+/* polled vectors were not raised by the VIC: nothing to acknowledge */
+static void vic_irq_eoi(struct irq_data *d)
+{
+	struct vic_irq_controller *vic = irq_data_get_irq_chip_data(d);
+
+	if (vic->kernel_va && !(vic->poll_mask & (1 << d->hwirq)))
+		vic_writel(vic, 0, VIC_REG_EOIR);
+}
+
+static struct irq_chip svec_vic_chip = {
+	.name = "svec-vic",
+	.irq_mask = vic_irq_mask,
+	.irq_unmask = vic_irq_unmask,
+	.irq_disable = vic_irq_mask,
+	.irq_eoi = vic_irq_eoi,
+};
+
+/* The fasteoi flow writes the EOI once the handler is done, so that the VIC
+   does not re-raise a source which is being serviced, and only masks the
+   vector (two more VME writes) for oneshot threaded handlers, until their
+   thread has run. */
+static int vic_irq_domain_map(struct irq_domain *d, unsigned int irq,
+			      irq_hw_number_t hwirq)
+{
+	irq_set_chip_data(irq, d->host_data);
+	irq_set_chip_and_handler(irq, &svec_vic_chip, handle_fasteoi_irq);
+	return 0;
+}
+
+static const struct irq_domain_ops vic_irq_domain_ops = {
+	.map = vic_irq_domain_map,
+};
+
+/*
+ * Interrupt storm detector. A vector whose handlers return IRQ_NONE more than
+ * irq_storm_threshold times in a second is masked in the VIC, and unmasked by
+ * storm_work once its backoff has expired: VIC_STORM_MIN_BACKOFF at first,
+ * doubled (up to VIC_STORM_MAX_BACKOFF) each time it storms again within ten
+ * backoff periods of being unmasked. The handlers requested through the
+ * carrier (fmc->op->irq_request() and the character device) are wrapped, and
+ * their IRQ_NONE counted; the kernel's own spurious interrupt detection
+ * covers those requested directly with request_irq().
+ */
+#define VIC_STORM_MIN_BACKOFF	(HZ / 100 ? HZ / 100 : 1)
+#define VIC_STORM_MAX_BACKOFF	(10 * HZ)
+
+static void vic_storm_note(struct vic_irq_controller *vic, int index)
+{
+	struct svec_dev *svec = vic->svec;
+	struct vector *vec = &vic->vectors[index];
+	unsigned long now = jiffies;
+
+	if (!svec->irq_storm_threshold)
+		return;
+
+	if (time_after_eq(now, vec->storm_window + HZ)) {
+		vec->storm_window = now;
+		vec->storm_count = 0;
+	}
+	if (++vec->storm_count <= svec->irq_storm_threshold)
+		return;
+
+	if (vec->storm_backoff &&
+	    time_before(now, vec->storm_until + 10 * vec->storm_backoff))
+		vec->storm_backoff = min_t(unsigned long, 2 * vec->storm_backoff,
+					   VIC_STORM_MAX_BACKOFF);
+	else
+		vec->storm_backoff = VIC_STORM_MIN_BACKOFF;
+	vec->storm_until = now + vec->storm_backoff;
+	vec->storms++;
+	svec->irq_stats.vic_storms++;
+
+	raw_spin_lock(&vic->mask_lock);
+	vic->storm_mask |= 1 << index;
+	vic_writel(vic, 1 << index, VIC_REG_IDR);
+	raw_spin_unlock(&vic->mask_lock);
+	schedule_delayed_work(&vic->storm_work, VIC_STORM_MIN_BACKOFF);
+
+	dev_warn_ratelimited(svec->dev,
+			     "VIC vector %d (id 0x%x): interrupt storm, masked for %u ms\n",
+			     index, vec->saved_id,
+			     jiffies_to_msecs(vec->storm_backoff));
+}
+
+static void vic_storm_work(struct work_struct *work)
+{
+	struct vic_irq_controller *vic =
+	    container_of(work, struct vic_irq_controller, storm_work.work);
+	struct svec_dev *svec = vic->svec;
+	unsigned long flags;
+	int i, again;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+
+	/* the cleanup cancels us, but may be disabling the VIC right now */
+	if (svec->vic != vic || !vic->kernel_va) {
+		spin_unlock_irqrestore(&svec->irq_lock, flags);
+		return;
+	}
+
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
+		struct vector *vec = &vic->vectors[i];
+
+		if (!(vic->storm_mask & (1 << i)) ||
+		    time_before(jiffies, vec->storm_until))
+			continue;
+
+		vec->storm_count = 0;
+		raw_spin_lock(&vic->mask_lock);
+		vic->storm_mask &= ~(1 << i);
+		if (vic_irq_sources(vic) & (1 << i))
+			vic_writel(vic, 1 << i, VIC_REG_IER);
+		raw_spin_unlock(&vic->mask_lock);
+	}
+	again = (vic->storm_mask != 0);
+
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	if (again)
+		schedule_delayed_work(&vic->storm_work, VIC_STORM_MIN_BACKOFF);
+}
+
+/* Notes what a wrapped handler of vector @index returned; called from the
+   dispatchers, with irq_lock held */
+static void vic_handler_done(struct vic_irq_controller *vic, int index,
+			     irqreturn_t rv)
+{
+	if (rv != IRQ_NONE)
+		return;
+	vic->vectors[index].unhandled++;
+	vic_storm_note(vic, index);
+}
+
+/* Wrapper giving the handlers registered through fmc->op->irq_request()
+   the same arguments they had before the VIC became an irq_domain */
+static irqreturn_t svec_vic_fmc_handler(int irq, void *dev_id)
+{
+	struct vector *vec = dev_id;
+	struct svec_dev *svec = vec->requestor->carrier_data;
+	irqreturn_t rv;
+
+	rv = vec->handler(vec->saved_id, vec->requestor);
+	vic_handler_done(svec->vic, vec - svec->vic->vectors, rv);
+	return rv;
+}
+
+/* The same, for the wrapper of the character device handler (svec-cdev.c) */
+void svec_vic_irq_note(struct svec_dev *svec, unsigned int irq, irqreturn_t rv)
+{
+	vic_handler_done(svec->vic, irqd_to_hwirq(irq_get_irq_data(irq)), rv);
+}
+
+static void svec_vic_unmap(struct vic_irq_controller *vic)
+{
+	int i;
+
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		if (vic->vectors[i].irq)
+			irq_dispose_mapping(vic->vectors[i].irq);
+
+	irq_domain_remove(vic->domain);
+}
+
+/*
+ * Mezzanine drivers (svec_irq_find_mapping() and request_irq()) may still hold
+ * vectors when the card lets the controller go. Their IRQ mappings can't be
+ * disposed of under them: the controller is kept on vic_orphans, with its
+ * registers out of reach, and freed once all its vectors have been released,
+ * at the next release or when the module is unloaded.
+ */
+static LIST_HEAD(vic_orphans);
+static DEFINE_MUTEX(vic_orphans_lock);
+
+static int svec_vic_busy(struct vic_irq_controller *vic)
+{
+	int i;
+
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		if (vic->vectors[i].irq && irq_has_action(vic->vectors[i].irq))
+			return 1;
+	return 0;
+}
+
+/* called with vic_orphans_lock held */
+static void svec_vic_reap(int force)
+{
+	struct vic_irq_controller *vic, *tmp;
+
+	list_for_each_entry_safe(vic, tmp, &vic_orphans, orphan) {
+		if (svec_vic_busy(vic)) {
+			if (!force)
+				continue;
+			WARN(1, "svec: VIC vectors still requested at unload\n");
+		}
+		list_del(&vic->orphan);
+		svec_vic_unmap(vic);
+		kfree(vic);
+	}
+}
+
+static void svec_vic_release(struct vic_irq_controller *vic)
+{
+	mutex_lock(&vic_orphans_lock);
+	svec_vic_reap(0);
+	vic->kernel_va = NULL;
+	if (svec_vic_busy(vic)) {
+		dev_warn(vic->svec->dev, "VIC vectors still requested, keeping "
+			 "their IRQs until they are freed\n");
+		vic->svec = NULL;
+		list_add(&vic->orphan, &vic_orphans);
+	} else {
+		svec_vic_unmap(vic);
+		kfree(vic);
+	}
+	mutex_unlock(&vic_orphans_lock);
+}
+
+/* Whether any vector of the card's VIC is requested, through whichever API */
+int svec_vic_requested(struct svec_dev *svec)
+{
+	unsigned long flags;
+	int rv;
+
+	/* the cleanup frees the VIC after clearing svec->vic under the lock */
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	rv = svec->vic && svec_vic_busy(svec->vic);
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+	return rv;
+}
+
+/* Module unload: every vector must have been freed by now */
+void svec_vic_exit(void)
+{
+	mutex_lock(&vic_orphans_lock);
+	svec_vic_reap(1);
+	mutex_unlock(&vic_orphans_lock);
+}
+
+/*
+ * Adaptive polling mode. A vector interrupting faster than irq_poll_threshold
+ * (per second) is masked in the VIC and serviced from an hrtimer every
+ * irq_poll_period_us, batching all the pending polled vectors into a single
+ * RISR read. It goes back to interrupt mode when its rate drops below half
+ * the threshold (or half the polling frequency, if lower), and at the next
+ * poll once the threshold is set to 0.
+ */
+static unsigned int vic_poll_exit_rate(struct svec_dev *svec)
+{
+	unsigned int poll_hz = USEC_PER_SEC / svec->irq_poll_period_us;
+
+	/* a rate of 0 is never below: a threshold of 1 must not trap it */
+	return max(min(svec->irq_poll_threshold, poll_hz) / 2, 1U);
+}
+
+/* Closes the rate window of a vector when it has elapsed; returns 1 if so */
+static int vic_rate_update(struct vector *vec)
+{
+	unsigned long now = jiffies;
+
+	if (time_before(now, vec->window_start + VIC_RATE_WINDOW))
+		return 0;
+
+	vec->rate = vec->window_count * HZ / (now - vec->window_start);
+	vec->window_start = now;
+	vec->window_count = 0;
+	return 1;
+}
+
+static void vic_poll_enter(struct vic_irq_controller *vic, int index)
+{
+	struct svec_dev *svec = vic->svec;
+
+	raw_spin_lock(&vic->mask_lock);
+	vic->poll_mask |= 1 << index;
+	vic_writel(vic, 1 << index, VIC_REG_IDR);
+	raw_spin_unlock(&vic->mask_lock);
+
+	if (!vic->polling) {
+		vic->polling = 1;
+		hrtimer_start(&vic->poll_timer,
+			      ns_to_ktime(svec->irq_poll_period_us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+static void vic_poll_leave(struct vic_irq_controller *vic, int index)
+{
+	raw_spin_lock(&vic->mask_lock);
+	vic->poll_mask &= ~(1 << index);
+
+	/* don't unmask what the owner (or the storm detector) disabled meanwhile */
+	if (vic_irq_sources(vic) & (1 << index))
+		vic_writel(vic, 1 << index, VIC_REG_IER);
+	raw_spin_unlock(&vic->mask_lock);
+}
+
+static enum hrtimer_restart svec_vic_poll(struct hrtimer *timer)
+{
+	struct vic_irq_controller *vic =
+	    container_of(timer, struct vic_irq_controller, poll_timer);
+	struct svec_dev *svec = vic->svec;
+	struct svec_irq_cpu_stats *stats;
+	unsigned long flags;
+	uint32_t pending, seen = 0;
+	int i, pass, restart;
+	ktime_t stamp;
+	u64 t;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	stamp = ktime_get();
+	stats = this_cpu_ptr(svec->irq_stats.cpu);
+
+	for (pass = 0; pass < VIC_POLL_BUDGET; pass++) {
+		pending = vic_readl(vic, VIC_REG_RISR) & vic->poll_mask &
+		    ~vic->storm_mask;
+		if (!pending)
+			break;
+
+		for (i = 0; i < VIC_MAX_VECTORS; i++) {
+			if (!(pending & (1 << i)))
+				continue;
+			vic->vectors[i].stamp = stamp;
+			svec_irq_hist_add(stats->dispatch_ns, svec_irq_since(stamp));
+			t = local_clock();
+			generic_handle_irq(vic->vectors[i].irq);
+			svec_irq_hist_add(stats->handler_ns, local_clock() - t);
+			vic->vectors[i].count++;
+		}
+		seen |= pending;
+	}
+
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
+		struct vector *vec = &vic->vectors[i];
+
+		if (!(vic->poll_mask & (1 << i)))
+			continue;
+
+		if (seen & (1 << i))
+			vec->window_count++;
+
+		if (!svec->irq_poll_threshold ||
+		    (vic_rate_update(vec) && vec->rate < vic_poll_exit_rate(svec)))
+			vic_poll_leave(vic, i);
+	}
+
+	restart = vic->polling = (vic->poll_mask != 0);
+
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	if (!restart)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer,
+			    ns_to_ktime(svec->irq_poll_period_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* Lists the vectors in use, with their current rate and mode */
+ssize_t svec_vic_show_vectors(struct svec_dev *svec, char *buf, size_t size)
+{
+	struct vic_irq_controller *vic;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	/* the VIC may go away under us: cleanup takes the same lock */
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	vic = svec->vic;
+	for (i = 0; vic && i < VIC_MAX_VECTORS; i++) {
+		struct vector *vec = &vic->vectors[i];
+
+		if (!test_bit(i, &vic->enabled) && !(vic->poll_mask & (1 << i)))
+			continue;
+
+		len += scnprintf(buf + len, size - len,
+				 "%2d 0x%08x irq %u %s %u/s\n", i, vec->saved_id,
+				 vec->irq,
+				 vic->storm_mask & (1 << i) ? "storm" :
+				 vic->poll_mask & (1 << i) ? "poll" : "irq",
+				 vec->rate);
+	}
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	return len;
+}
+
+/* VIC control word: active high, edge sensitive with the card's retry timer */
+static uint32_t vic_ctl(struct svec_dev *svec)
+{
+	return VIC_CTL_ENABLE | VIC_CTL_POL | VIC_CTL_EMU_EDGE |
+	    VIC_CTL_EMU_LEN_W(svec->vic_retry_len);
+}
+
+void svec_vic_set_retry(struct svec_dev *svec, unsigned int len)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	svec->vic_retry_len = len;
+	if (svec->vic)
+		vic_writel(svec->vic, vic_ctl(svec), VIC_REG_CTL);
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+}
+
+/*
+ * Retry timer auto-tuning. The timer is the delay after which the VIC pulses
+ * its output again for a source still pending after an EOI, so it bounds the
+ * latency of a missed edge. If it is shorter than the time we need to service
+ * a vector, the VIC re-raises sources the dispatch loop is about to handle
+ * anyway, and the extra VME interrupt finds nothing to do (a spurious one).
+ * Once per second: lengthen the timer by 1/4 if more than 1% of the
+ * interrupts were spurious, otherwise shorten it by 1/8, never below twice
+ * the average handler service time. Rates and average are those of the
+ * last period, not of the card's lifetime.
+ */
+#define VIC_TUNE_PERIOD		HZ
+#define VIC_TUNE_MIN_LEN	(10 * SVEC_VIC_TICKS_PER_US)
+
+void svec_vic_tune_work(struct work_struct *work)
+{
+	struct svec_dev *svec =
+	    container_of(work, struct svec_dev, vic_tune_work.work);
+	struct svec_irq_stats *st = &svec->irq_stats;
+	unsigned long count, irqs, spurious, services, flags, len, floor;
+	u64 avg_ns = 0;
+
+	if (!svec->vic_retry_autotune)
+		return;
+
+	/* all of it over the last period only */
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	count = svec_irq_count(svec);
+	irqs = count - svec->vic_tune_irqs;
+	spurious = st->spurious - svec->vic_tune_spurious;
+	services = st->vic_service_count - svec->vic_tune_service_count;
+	if (services) {
+		avg_ns = st->vic_service_ns - svec->vic_tune_service_ns;
+		do_div(avg_ns, services);
+	}
+	svec->vic_tune_irqs = count;
+	svec->vic_tune_spurious = st->spurious;
+	svec->vic_tune_service_ns = st->vic_service_ns;
+	svec->vic_tune_service_count = st->vic_service_count;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	/* twice the average service time, in VIC ticks */
+	floor = 2 * (unsigned long)avg_ns * SVEC_VIC_TICKS_PER_US / NSEC_PER_USEC;
+	floor = clamp_t(unsigned long, floor, VIC_TUNE_MIN_LEN,
+			SVEC_VIC_MAX_RETRY_LEN);
+	len = svec->vic_retry_len;
+
+	if (irqs && spurious * 100 > irqs)
+		len += len / 4;
+	else
+		len -= len / 8;
+
+	len = clamp_t(unsigned long, len, floor, SVEC_VIC_MAX_RETRY_LEN);
+
+	if (len != svec->vic_retry_len) {
+		svec_vic_set_retry(svec, len);
+		st->vic_retry_tunes++;
+	}
+
+	schedule_delayed_work(&svec->vic_tune_work, VIC_TUNE_PERIOD);
+}
+
+/*
+ * Busy-poll mode, for latency-critical channels. A kthread bound to
+ * irq_busy_poll_cpu (preferably an isolated one) reads RISR in a loop and
+ * has the pending vectors dispatched, bypassing the VME bridge interrupt
+ * path. The handlers expect hardirq context: the dispatch runs from an
+ * irq_work the thread raises on its own CPU, and waits for. irq_busy_poll_ns is the delay between two polls (0: back to back).
+ * After VIC_BUSY_IDLE_POLLS empty polls the thread backs off, doubling its
+ * sleep up to irq_busy_poll_idle_us (0: never sleep), until a vector fires.
+ * The VME interrupt stays enabled as the fallback: whichever path comes first
+ * services the vector, the other one finds nothing pending.
+ */
+#define VIC_BUSY_IDLE_POLLS	10000
+
+/* Serializes starting and stopping the polling thread */
+static DEFINE_MUTEX(vic_busy_poll_lock);
+
+/* The dispatch of what the thread found, in hardirq context like the VME
+   interrupt; the VME interrupt may have serviced it meanwhile */
+static void vic_busy_poll_dispatch(struct irq_work *work)
+{
+	struct svec_dev *svec =
+	    container_of(work, struct svec_dev, busy_poll_work);
+	struct vic_irq_controller *vic;
+	unsigned long flags;
+	int rv = 0;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	vic = svec->vic;
+	if (vic && (vic_readl(vic, VIC_REG_RISR) & vic_irq_sources(vic))) {
+		svec_irq_hist_add(this_cpu_ptr(svec->irq_stats.cpu)->busy_gap_ns,
+				  svec->busy_poll_gap);
+		svec->irq_stats.busy_poll_hits++;
+		rv = svec_vic_irq_dispatch(svec, svec->busy_poll_stamp,
+					   svec->busy_poll_entry) == IRQ_HANDLED;
+	}
+	svec->busy_poll_handled = rv;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+}
+
+/* One RISR poll, @gap ns after the previous one; returns 1 if it found work */
+static int vic_busy_poll_once(struct svec_dev *svec, u64 gap)
+{
+	struct vic_irq_controller *vic;
+	unsigned long flags;
+	int pending;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	vic = svec->vic;
+	pending = vic && (vic_readl(vic, VIC_REG_RISR) & vic_irq_sources(vic));
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	if (!pending)
+		return 0;
+
+	svec->busy_poll_stamp = ktime_get();
+	svec->busy_poll_entry = local_clock();
+	svec->busy_poll_gap = gap;
+	svec->busy_poll_handled = 0;
+	irq_work_queue(&svec->busy_poll_work);
+	irq_work_sync(&svec->busy_poll_work);
+
+	return svec->busy_poll_handled;
+}
+
+static int vic_busy_poll_thread(void *data)
+{
+	struct svec_dev *svec = data;
+	unsigned int idle = 0, sleep_us = 1;
+	u64 now, last = local_clock();
+
+	while (!kthread_should_stop()) {
+		now = local_clock();
+		if (vic_busy_poll_once(svec, now - last)) {
+			idle = 0;
+			sleep_us = 1;
+		} else if (idle < VIC_BUSY_IDLE_POLLS)
+			idle++;
+		last = now;
+
+		if (idle == VIC_BUSY_IDLE_POLLS && svec->irq_busy_poll_idle_us) {
+			usleep_range(sleep_us, 2 * sleep_us);
+			sleep_us = min(2 * sleep_us, svec->irq_busy_poll_idle_us);
+		} else if (svec->irq_busy_poll_ns)
+			ndelay(svec->irq_busy_poll_ns);
+		else
+			cpu_relax();
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* Starts the polling thread on @cpu, or stops it if @cpu is negative */
+int svec_vic_busy_poll(struct svec_dev *svec, int cpu)
+{
+	struct task_struct *task;
+	int rv = 0;
+
+	if (cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+
+	mutex_lock(&vic_busy_poll_lock);
+
+	if (svec->busy_poll_task) {
+		kthread_stop(svec->busy_poll_task);
+		svec->busy_poll_task = NULL;
+		svec->irq_busy_poll_cpu = -1;
+	}
+
+	if (cpu < 0)
+		goto out;
+
+	/* the thread is stopped: nothing is queued */
+	init_irq_work(&svec->busy_poll_work, vic_busy_poll_dispatch);
+	task = kthread_create(vic_busy_poll_thread, svec, "%s-poll", svec->name);
+	if (IS_ERR(task)) {
+		rv = PTR_ERR(task);
+		goto out;
+	}
+	kthread_bind(task, cpu);
+	svec->busy_poll_task = task;
+	svec->irq_busy_poll_cpu = cpu;
+	wake_up_process(task);
+
+	if(svec->verbose)
+	dev_info(svec->dev, "busy-polling the VIC on cpu %d\n", cpu);
+
+      out:
+	mutex_unlock(&vic_busy_poll_lock);
+	return rv;
+}
+
+/*
+ * The controller is kept across cleanups, with its SDB address, the original
+ * vector table and the Linux IRQ mappings, as long as the card runs the same
+ * gateware (svec->fw_hash): re-initializing it after a reconfiguration or a
+ * reload of the mezzanine driver then costs no SDB walk and no IVT readback.
+ */
+#define VIC_NO_HASH	0xffffffff
+
+void svec_vic_free_cache(struct svec_dev *svec)
+{
+	struct vic_irq_controller *vic = svec->vic_cache;
+
+	if (!vic)
+		return;
+
+	svec->vic_cache = NULL;
+	svec_vic_release(vic);
+}
+
+/* Takes the cached controller if still valid, resetting its run-time state */
+static struct vic_irq_controller *svec_vic_reuse(struct svec_dev *svec)
+{
+	struct vic_irq_controller *vic = svec->vic_cache;
+	int i;
+
+	if (!vic || vic->fw_hash != svec->fw_hash) {
+		svec_vic_free_cache(svec);
+		return NULL;
+	}
+	svec->vic_cache = NULL;
+
+	vic->kernel_va = svec->map[MAP_REG]->kernel_va + vic->base;
+	vic->enabled = 0;
+	vic->poll_mask = 0;
+	vic->polling = 0;
+	vic->storm_mask = 0;
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
+		struct vector *vec = &vic->vectors[i];
+
+		vec->handler = NULL;
+		vec->requestor = NULL;
+		vec->window_start = jiffies;
+		vec->window_count = 0;
+		vec->rate = 0;
+		vec->storm_count = 0;
+		vec->storm_backoff = 0;
+	}
+
+	if(svec->verbose)
+	dev_info(svec->dev, "Reusing VIC @ 0x%x\n", vic->base);
+
+	return vic;
+}
+
 static int svec_vic_init(struct svec_dev *svec, struct fmc_device *fmc)
 {
 	int i;
 	signed long vic_base;
 	struct vic_irq_controller *vic;
+	unsigned long flags;
+
+	vic = svec_vic_reuse(svec);
+	if (vic) {
+		/* the vector table was restored by the cleanup: rewrite it */
+		vic_writel(vic, 0xffffffff, VIC_REG_IDR);
+		for (i = 0; i < VIC_MAX_VECTORS; i++)
+			vic_writel(vic, i, VIC_IVT_RAM_BASE + 4 * i);
+		goto setup;
+	}
 
 	/* Try to look up the VIC in the SDB tree - note that IRQs shall be requested after the
 	   FMC driver has scanned the SDB tree */
@@ -80,75 +835,249 @@ static int svec_vic_init(struct svec_dev *svec, struct fmc_device *fmc)
 
 	vic->kernel_va = svec->map[MAP_REG]->kernel_va + vic_base;
 	vic->base = (uint32_t) vic_base;
+	vic->svec = svec;
+
+	raw_spin_lock_init(&vic->mask_lock);
+	hrtimer_init(&vic->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	vic->poll_timer.function = svec_vic_poll;
+	INIT_DELAYED_WORK(&vic->storm_work, vic_storm_work);
+
+	vic->domain = irq_domain_add_linear(NULL, VIC_MAX_VECTORS,
+					    &vic_irq_domain_ops, vic);
+	if (!vic->domain) {
+		kfree(vic);
+		return -ENOMEM;
+	}
 
-	/* disable all IRQs, copy the vector table with pre-defined IRQ ids */
+	/* disable all IRQs, copy the vector table with pre-defined IRQ ids and
+	   make the VIC return vector indices in VAR */
 	vic_writel(vic, 0xffffffff, VIC_REG_IDR);
-	for (i = 0; i < VIC_MAX_VECTORS; i++)
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
 		vic->vectors[i].saved_id =
 		    vic_readl(vic, VIC_IVT_RAM_BASE + 4 * i);
+		vic_writel(vic, i, VIC_IVT_RAM_BASE + 4 * i);
 
+		vic->vectors[i].irq = irq_create_mapping(vic->domain, i);
+		if (!vic->vectors[i].irq) {
+			dev_err(svec->dev, "can't map VIC vector %d\n", i);
+			goto fail;
+		}
+	}
+
+      setup:
 	/* configure the VIC output: active high, edge sensitive, pulse width = 1 tick (16 ns) */
-	vic_writel(vic,
-		   VIC_CTL_ENABLE | VIC_CTL_POL | VIC_CTL_EMU_EDGE |
-		   VIC_CTL_EMU_LEN_W(40000), VIC_REG_CTL); /* 160 us IRQ retry timer */
+	vic_writel(vic, vic_ctl(svec), VIC_REG_CTL);
 
+	vic->fw_hash = svec->fw_hash;
 	vic->initialized = 1;
+	spin_lock_irqsave(&svec->irq_lock, flags);
 	svec->vic = vic;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
 
 	return 0;
+
+      fail:
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		vic_writel(vic, vic->vectors[i].saved_id,
+			   VIC_IVT_RAM_BASE + 4 * i);
+	svec_vic_unmap(vic);
+	kfree(vic);
+	return -ENOMEM;
 }
 
 void svec_vic_cleanup(struct svec_dev *svec)
 {
-	if (!svec->vic)
+	struct vic_irq_controller *vic = svec->vic;
+	unsigned long flags;
+	int i;
+
+	if (!vic)
 		return;
 
-	/* Disable all irq lines and the VIC in general */
-	vic_writel(svec->vic, 0xffffffff, VIC_REG_IDR);
-	vic_writel(svec->vic, 0, VIC_REG_CTL);
-	kfree(svec->vic);
+	/* Release what the FMC drivers left behind through fmc->op->irq_request();
+	   userspace vectors were freed by svec_cdev_irq_exit() */
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		if (vic->vectors[i].handler)
+			free_irq(vic->vectors[i].irq, &vic->vectors[i]);
+
+	/* the dispatchers and the busy-poll thread look the VIC up under the lock */
+	spin_lock_irqsave(&svec->irq_lock, flags);
 	svec->vic = NULL;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	/* nothing can dispatch (start polling, detect a storm) anymore */
+	hrtimer_cancel(&vic->poll_timer);
+	cancel_delayed_work_sync(&vic->storm_work);
+
+	/* Disable all irq lines and the VIC in general, restore the vector table */
+	vic_writel(vic, 0xffffffff, VIC_REG_IDR);
+	vic_writel(vic, 0, VIC_REG_CTL);
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		vic_writel(vic, vic->vectors[i].saved_id,
+			   VIC_IVT_RAM_BASE + 4 * i);
+
+	/* keep it for the next initialization, unless the gateware is unknown
+	   or a driver still holds one of its vectors */
+	svec_vic_free_cache(svec);
+	if (vic->fw_hash != VIC_NO_HASH && vic->fw_hash == svec->fw_hash &&
+	    !svec_vic_busy(vic)) {
+		vic->kernel_va = NULL;
+		svec->vic_cache = vic;
+		return;
+	}
+
+	svec_vic_release(vic);
 }
 
-irqreturn_t svec_vic_irq_dispatch(struct svec_dev * svec)
+irqreturn_t svec_vic_irq_dispatch(struct svec_dev * svec, ktime_t stamp,
+				  u64 entry)
 {
 	struct vic_irq_controller *vic = svec->vic;
-	int index, rv;
+	struct svec_irq_cpu_stats *stats = this_cpu_ptr(svec->irq_stats.cpu);
 	struct vector *vec;
+	int index, handled = 0;
+	u64 t;
 
 	do {
 		/* Our parent IRQ handler: read the index value from the Vector Address Register,
-		   and find matching handler */
+		   and run the flow handler of the matching Linux IRQ, which acks it */
 		index = vic_readl(vic, VIC_REG_VAR) & 0xff;
 
-		if (index >= VIC_MAX_VECTORS)
+		if (index >= VIC_MAX_VECTORS ||
+		    !(vic_irq_sources(vic) & (1 << index)))
 			goto fail;
 
 		vec = &vic->vectors[index];
-		if (!vec->handler)
-			goto fail;
+		vec->stamp = stamp;
+		t = svec_irq_since(stamp);
+		svec_irq_hist_add(stats->dispatch_ns, t);
+		trace_svec_vic_dispatch(svec, index, vec->saved_id, t);
+		t = local_clock();
+		generic_handle_irq(vec->irq);
+		t = local_clock() - t;
+		svec_irq_hist_add(stats->handler_ns, t);
+		svec->irq_stats.vic_service_ns += t;
+		svec->irq_stats.vic_service_count++;
+		if (handled)
+			svec->irq_stats.vic_extra_passes++;
 
-		rv = vec->handler(vec->saved_id, vec->requestor);
-		    
-		vic_writel(vic, 0, VIC_REG_EOIR);	/* ack the irq */
+		/* the flow handler has written the EOI */
+		t = local_clock() - entry;
+		svec_irq_hist_add(stats->eoi_ns, t);
+		trace_svec_vic_eoi(svec, index, vec->saved_id, t);
+		vec->count++;
+		handled++;
 
-		if(rv < 0)
-		    break;
+		/* too many interrupts from this vector? switch it to polling */
+		vec->window_count++;
+		if (vic_rate_update(vec) && svec->irq_poll_threshold &&
+		    vec->rate > svec->irq_poll_threshold)
+			vic_poll_enter(vic, index);
 
-	/* check if any IRQ is still pending */
-	} while (vic_readl(vic, VIC_REG_RISR));
+	/* check if any enabled IRQ is still pending */
+	} while (vic_readl(vic, VIC_REG_RISR) & vic_irq_sources(vic));
 	
-	return rv;
+	return IRQ_HANDLED;
 
       fail:
-	return 0;
+	if (!handled)
+		svec->irq_stats.spurious++;
+	return handled ? IRQ_HANDLED : IRQ_NONE;
 }
 
-int svec_vic_irq_request(struct svec_dev *svec, struct fmc_device *fmc,
-			 unsigned long id, irq_handler_t handler)
+/*
+ * Arrival of the interrupt vector @id was last dispatched for. Called from
+ * its handler, with irq_lock held by the dispatcher, or from its threaded
+ * handler: the VIC can't go away while the vector is requested.
+ */
+ktime_t svec_vic_timestamp(struct svec_dev *svec, unsigned long id)
+{
+	struct vic_irq_controller *vic = ACCESS_ONCE(svec->vic);
+	int i;
+
+	for (i = 0; vic && i < VIC_MAX_VECTORS; i++)
+		if (vic->vectors[i].saved_id == id)
+			return vic->vectors[i].stamp;
+	return ktime_set(0, 0);
+}
+
+/* Enabled sources pending in interrupt mode; called with irq_lock held */
+uint32_t svec_vic_pending(struct svec_dev *svec)
+{
+	struct vic_irq_controller *vic = svec->vic;
+
+	return vic_readl(vic, VIC_REG_RISR) & vic_irq_sources(vic);
+}
+
+/* Per-vector statistics, for debugfs */
+void svec_vic_show_stats(struct svec_dev *svec, struct seq_file *m)
 {
 	struct vic_irq_controller *vic;
-	int rv = 0, i;
+	unsigned long flags;
+	int i;
+
+	seq_printf(m, "vic retry timer: %u ticks (%u us)%s\n",
+		   svec->vic_retry_len,
+		   svec->vic_retry_len / SVEC_VIC_TICKS_PER_US,
+		   svec->vic_retry_autotune ? ", auto-tuned" : "");
+	seq_printf(m, "vic extra passes: %lu retry tunes: %lu\n",
+		   svec->irq_stats.vic_extra_passes,
+		   svec->irq_stats.vic_retry_tunes);
+	if (svec->busy_poll_task)
+		seq_printf(m, "vic busy-poll: cpu %d, %lu hits\n",
+			   svec->irq_busy_poll_cpu, svec->irq_stats.busy_poll_hits);
+
+	/* the VIC may go away under us: cleanup takes the same lock */
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	vic = svec->vic;
+	if (!vic)
+		goto out;
+
+	seq_printf(m, "vic storms: %lu\n", svec->irq_stats.vic_storms);
+	seq_printf(m, "vic vector  id          irq   count       unhandled   storms\n");
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
+		struct vector *vec = &vic->vectors[i];
+
+		if (!vec->count && !test_bit(i, &vic->enabled))
+			continue;
+		seq_printf(m, "%10d  0x%08x  %-5u %-11lu %-11lu %lu\n", i,
+			   vec->saved_id, vec->irq, vec->count, vec->unhandled,
+			   vec->storms);
+	}
+      out:
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+}
+
+void svec_vic_reset_stats(struct svec_dev *svec)
+{
+	int i;
+
+	svec->irq_stats.vic_service_ns = 0;
+	svec->irq_stats.vic_service_count = 0;
+	svec->irq_stats.vic_extra_passes = 0;
+	svec->irq_stats.vic_retry_tunes = 0;
+	svec->irq_stats.busy_poll_hits = 0;
+	svec->irq_stats.vic_storms = 0;
+	svec->vic_tune_irqs = 0;
+	svec->vic_tune_spurious = 0;
+	svec->vic_tune_service_ns = 0;
+	svec->vic_tune_service_count = 0;
+
+	if (!svec->vic)
+		return;
+
+	for (i = 0; i < VIC_MAX_VECTORS; i++) {
+		svec->vic->vectors[i].count = 0;
+		svec->vic->vectors[i].unhandled = 0;
+		svec->vic->vectors[i].storms = 0;
+	}
+}
+
+/* Looks up the vector with a given SDB id, initializing the VIC if needed */
+static int svec_vic_find_vector(struct svec_dev *svec, struct fmc_device *fmc,
+				unsigned long id)
+{
+	int rv, i;
 
 	/* First interrupt to be requested? Look up and init the VIC */
 	if (!svec->vic) {
@@ -157,27 +1086,72 @@ int svec_vic_irq_request(struct svec_dev *svec, struct fmc_device *fmc,
 			return rv;
 	}
 
-	vic = svec->vic;
+	for (i = 0; i < VIC_MAX_VECTORS; i++)
+		if (svec->vic->vectors[i].saved_id == id)
+			return i;
 
-	for (i = 0; i < VIC_MAX_VECTORS; i++) {
-		/* find the vector in the stored table, assign handler and enable the line if exists */
-		if (vic->vectors[i].saved_id == id) {
-			spin_lock(&svec->irq_lock);
+	return -EINVAL;
+}
 
-			vic_writel(vic, i, VIC_IVT_RAM_BASE + 4 * i);
-			vic->vectors[i].requestor = fmc;
-			vic->vectors[i].handler = handler;
-			vic_writel(vic, (1 << i), VIC_REG_IER);
+int svec_vic_irq_map(struct svec_dev *svec, struct fmc_device *fmc,
+		     unsigned long id)
+{
+	int i;
+
+	i = svec_vic_find_vector(svec, fmc, id);
+	if (i < 0)
+		return i;
 
-			spin_unlock(&svec->irq_lock);
+	return svec->vic->vectors[i].irq;
+}
 
-			return 0;
+/* The IRQ of vector @id if the VIC is up, -ENODEV if it is not */
+int svec_vic_irq_lookup(struct svec_dev *svec, unsigned long id)
+{
+	unsigned long flags;
+	int i, irq = -ENODEV;
 
-		}
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	if (svec->vic) {
+		irq = -EINVAL;
+		for (i = 0; i < VIC_MAX_VECTORS; i++)
+			if (svec->vic->vectors[i].saved_id == id) {
+				irq = svec->vic->vectors[i].irq;
+				break;
+			}
 	}
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
 
-	return -EINVAL;
+	return irq;
+}
 
+int svec_vic_irq_request(struct svec_dev *svec, struct fmc_device *fmc,
+			 unsigned long id, irq_handler_t handler,
+			 const char *name)
+{
+	struct vector *vec;
+	unsigned long flags;
+	int rv, i;
+
+	i = svec_vic_find_vector(svec, fmc, id);
+	if (i < 0)
+		return i;
+
+	vec = &svec->vic->vectors[i];
+	if (vec->handler)
+		return -EBUSY;
+
+	spin_lock_irqsave(&svec->irq_lock, flags);
+	vec->requestor = fmc;
+	vec->handler = handler;
+	spin_unlock_irqrestore(&svec->irq_lock, flags);
+
+	/* request_irq() unmasks the line through the irq_chip (VIC_REG_IER) */
+	rv = request_irq(vec->irq, svec_vic_fmc_handler, 0, name, vec);
+	if (rv)
+		vec->handler = NULL;
+
+	return rv;
 }
 
 int svec_vic_irq_free(struct svec_dev *svec, unsigned long id)
@@ -185,15 +1159,12 @@ int svec_vic_irq_free(struct svec_dev *svec, unsigned long id)
 	int i;
 
 	for (i = 0; i < VIC_MAX_VECTORS; i++) {
-		uint32_t vec = svec->vic->vectors[i].saved_id;
-		if (vec == id) {
-			spin_lock(&svec->irq_lock);
-
-			vic_writel(svec->vic, 1 << i, VIC_REG_IDR);
-			vic_writel(svec->vic, vec, VIC_IVT_RAM_BASE + 4 * i);
-			svec->vic->vectors[i].handler = NULL;
+		struct vector *vec = &svec->vic->vectors[i];
 
-			spin_unlock(&svec->irq_lock);
+		if (vec->saved_id == id && vec->handler) {
+			/* free_irq() masks the line through VIC_REG_IDR */
+			free_irq(vec->irq, vec);
+			vec->handler = NULL;
 		}
 	}
 
@@ -11,6 +11,16 @@
 #define __SVEC_H__
 
 #include <linux/firmware.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/irq_work.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/i2c.h>
+#include <linux/i2c-algo-bit.h>
 #include <linux/fmc.h>
 #include "vmebus.h"
 
@@ -35,9 +45,24 @@
 /* The eeprom is at address 0x50 */
 /* FIXME ? Copied from spec.h */
 #define SVEC_I2C_EEPROM_SIZE (8 * 1024)
+/* ... cached in chunks of this size (see svec-i2c.c) */
+#define SVEC_I2C_EEPROM_CHUNK	256
+#define SVEC_I2C_EEPROM_CHUNKS	(SVEC_I2C_EEPROM_SIZE / SVEC_I2C_EEPROM_CHUNK)
 
 #define SVEC_MAX_GATEWARE_SIZE 0x420000
 
+#define SVEC_DEFAULT_IRQ_POLL_PERIOD_US	100
+#define SVEC_DEFAULT_IRQ_STORM_THRESHOLD	1000	/* unhandled irqs per second */
+
+/* VIC edge emulation retry timer: 250 ticks per microsecond, 16-bit field */
+#define SVEC_VIC_TICKS_PER_US		250
+#define SVEC_VIC_MAX_RETRY_LEN		0xffff
+#define SVEC_DEFAULT_VIC_RETRY_LEN	40000	/* 160 us */
+
+/* VIC busy-poll mode: longest poll interval and idle backoff sleep */
+#define SVEC_MAX_BUSY_POLL_NS		100000
+#define SVEC_DEFAULT_BUSY_POLL_IDLE_US	100
+
 enum svec_map_win {
 	MAP_CR_CSR = 0,		/* CR/CSR */
 	MAP_REG,		/* A32/A24/A16 space */
@@ -52,10 +77,107 @@ struct svec_config {
 	uint32_t vic_base;
 	int interrupt_vector;
 	int interrupt_level;
+	int slot_vector[SVEC_N_SLOTS];	/* per-slot VME vectors, -1 = interrupt_vector */
 	int use_vic;
 	int use_fmc;
 };
 
+/* Interrupt statistics (see svec-debugfs.c). Histograms are log2: bucket 0
+   counts durations below 128 ns, bucket n > 0 those from 2^(n+6) ns. */
+#define SVEC_IRQ_HIST_BUCKETS	16
+
+struct svec_irq_cpu_stats {
+	unsigned long irqs;	/* VME interrupts, see svec_irq_count() */
+	unsigned long handler_ns[SVEC_IRQ_HIST_BUCKETS];	/* handler duration */
+	unsigned long eoi_ns[SVEC_IRQ_HIST_BUCKETS];	/* handler entry to EOI */
+	unsigned long dispatch_ns[SVEC_IRQ_HIST_BUCKETS];	/* timestamp to dispatch */
+	unsigned long busy_gap_ns[SVEC_IRQ_HIST_BUCKETS];	/* busy-poll detection gap */
+};
+
+struct svec_irq_stats {
+	struct svec_irq_cpu_stats __percpu *cpu;
+	unsigned long spurious;
+	u64 vic_service_ns;		/* total VIC handler time ... */
+	unsigned long vic_service_count;	/* ... over this many handlers */
+	unsigned long vic_extra_passes;	/* dispatch loop passes after the first one */
+	unsigned long vic_retry_tunes;	/* retry timer changes made by auto-tuning */
+	unsigned long vic_storms;	/* vectors masked by the storm detector */
+	unsigned long busy_poll_hits;	/* RISR polls of the busy-poll thread finding work */
+	unsigned long shared_calls[SVEC_N_SLOTS];	/* shared IRQ mode */
+	unsigned long shared_unhandled[SVEC_N_SLOTS];
+	unsigned long shared_skipped[SVEC_N_SLOTS];	/* nothing pending, not called */
+	unsigned long shared_rechecks;	/* extra passes over the pending queries */
+	unsigned long demux_checks;	/* RISR checks on a vector shared by several cards */
+	unsigned long demux_hits;	/* ... which found a source pending */
+};
+
+static inline void svec_irq_hist_add(unsigned long *hist, u64 ns)
+{
+	int bucket = fls64(ns >> 7);
+
+	hist[min(bucket, SVEC_IRQ_HIST_BUCKETS - 1)]++;
+}
+
+/* ns from the timestamp of an interrupt to now, for the dispatch histogram */
+static inline u64 svec_irq_since(ktime_t stamp)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), stamp));
+}
+
+/* A VME vector dedicated to one slot, so that each mezzanine can raise its
+   own interrupt and be serviced on its own CPU (see svec-irq.c) */
+struct svec_slot_irq {
+	struct svec_dev *svec;
+	int slot;
+	int vector;		/* registered vector, -1 if none */
+	spinlock_t lock;	/* serializes the handler of this slot only */
+	ktime_t timestamp;	/* of the interrupt the handler was last called for */
+	unsigned long count;
+};
+
+/* A VME vector, possibly shared by several cards (see svec-irq.c) */
+struct svec_vme_vector {
+	struct list_head list;
+	int vector;
+	spinlock_t lock;
+	struct svec_dev *cards[SVEC_MAX_DEVICES];
+	int n_cards;
+	int last;		/* index of the card which had work last */
+	unsigned long spurious;	/* interrupts no card had work for */
+};
+
+/* The I2C bus of a mezzanine slot, bit-banged through the golden gateware:
+   used by the driver for the FRU EEPROM, and registered as an i2c-algo-bit
+   adapter for everybody else (see svec-i2c.c) */
+struct svec_i2c {
+	struct fmc_device *fmc;
+	struct mutex lock;	/* one transfer at a time on the bus */
+	uint32_t shadow;	/* last value written to the output bits */
+	int shadowed;		/* 0: read-modify-write, only to benchmark */
+	unsigned int write_ns, read_ns;	/* VME access times, measured */
+	unsigned int delay_ns;	/* added to each edge of the fast path */
+	unsigned int khz;	/* bit rate measured on the EEPROM */
+	int hw;			/* using the hardware master at hw_base */
+	unsigned long hw_base;
+	int hw_start;		/* start condition to send with the next byte */
+	uint8_t *eeprom;	/* EEPROM image, read on demand */
+	DECLARE_BITMAP(valid, SVEC_I2C_EEPROM_CHUNKS);	/* chunks read */
+	int present;		/* the image belongs to the mezzanine we see */
+	struct work_struct init_work;	/* svec_i2c_init(), in parallel */
+	int init_ret;
+	struct i2c_adapter adap;
+	struct i2c_algo_bit_data bit;
+	struct i2c_msg *xfer_msgs;	/* transfer of the adapter, under the lock */
+	int xfer_num;
+	int registered;
+};
+
+/* The SDB tree of a gateware, copied to the fmc devices (see svec-fmc.c) */
+struct svec_sdb {
+	struct sdb_array *tree;
+	uint32_t fw_hash;	/* of the bitstream it was read from */
+};
+
 #define SVEC_FLAG_FMCS_REGISTERED 	0
 #define SVEC_FLAG_IRQS_REQUESTED  	1
 #define SVEC_FLAG_BOOTLOADER_ACTIVE 	2
@@ -77,14 +199,52 @@ struct svec_dev {
 
 	struct fmc_device *fmcs[SVEC_N_SLOTS];
 	irq_handler_t fmc_handlers[SVEC_N_SLOTS];
+	int (*fmc_pending[SVEC_N_SLOTS])(struct fmc_device *fmc);
+	struct svec_slot_irq slot_irq[SVEC_N_SLOTS];
+	struct svec_i2c i2c[SVEC_N_SLOTS];
+	struct svec_sdb *sdb;		/* cached tree of the current gateware */
+	void *sdb_blob;			/* SDB records for userspace, ... */
+	size_t sdb_blob_len;
+	uint32_t sdb_blob_hash;		/* ... of this bitstream */
+	struct mutex sdb_lock;
 
 	/* FMC devices */
 	int fmcs_n;		/* Number of FMC devices */
-	unsigned long irq_count;	/* for mezzanine use too */
 	unsigned int current_vector;
+	struct svec_vme_vector *vme_vector;
 	spinlock_t irq_lock;
 
 	struct vic_irq_controller *vic;
+	struct vic_irq_controller *vic_cache;	/* kept across cleanups, see svec-vic.c */
+	unsigned int irq_poll_threshold;	/* VIC polling mode above this rate (irq/s), 0 = off */
+	unsigned int irq_poll_period_us;	/* VIC polling period */
+	unsigned int irq_storm_threshold;	/* unhandled irqs/s masking a vector, 0 = off */
+	struct svec_irq_stats irq_stats;
+	struct dentry *dbg_dir;
+
+	/* VIC edge emulation retry timer, in VIC clock ticks, and its auto-tuning */
+	unsigned int vic_retry_len;
+	int vic_retry_autotune;
+	struct delayed_work vic_tune_work;
+	unsigned long vic_tune_irqs, vic_tune_spurious;	/* counters at last tuning */
+	u64 vic_tune_service_ns;
+	unsigned long vic_tune_service_count;
+
+	/* VIC busy-poll mode: polling thread, its CPU (-1 = off) and timing */
+	struct task_struct *busy_poll_task;
+	int irq_busy_poll_cpu;
+	unsigned int irq_busy_poll_ns;
+	unsigned int irq_busy_poll_idle_us;
+	/* a vector found pending by the thread, dispatched from hardirq context */
+	struct irq_work busy_poll_work;
+	ktime_t busy_poll_stamp;
+	u64 busy_poll_entry, busy_poll_gap;
+	int busy_poll_handled;
+
+	/* /dev/svec.<lun>, and its open files (see svec-cdev.c) */
+	struct miscdevice misc;
+	struct list_head irq_files;
+	struct vme_mapping *mmap_win;	/* window for mmap(), NULL if none */
 	uint32_t vme_raw_addr;	/* VME address for raw VME I/O through vme_addr/vme_data attributes */
 	int verbose;
 
@@ -106,14 +266,32 @@ extern char *svec_fw_name;
 /* Functions in svec-fmc.c, used by svec-vme.c */
 extern int svec_fmc_create(struct svec_dev *svec);
 extern void svec_fmc_destroy(struct svec_dev *svec);
+extern void svec_fmc_free_sdb(struct svec_dev *svec);
+extern ssize_t svec_sdb_read_blob(struct svec_dev *svec, char *buf,
+				  loff_t off, size_t count);
+extern ssize_t svec_sdb_show_devices(struct svec_dev *svec, char *buf,
+				     size_t size);
 
 /* Functions in svec-i2c.c, used by svec-fmc.c */
 extern int svec_i2c_init(struct fmc_device *fmc);
+extern int svec_i2c_init_slots(struct svec_dev *svec);
 extern void svec_i2c_exit(struct fmc_device *fmc);
 extern int svec_eeprom_read(struct fmc_device *fmc, uint32_t offset,
 			    void *buf, size_t size);
 extern int svec_eeprom_write(struct fmc_device *fmc, uint32_t offset,
 			     const void *buf, size_t size);
+extern int svec_eeprom_read_cached(struct fmc_device *fmc, uint32_t offset,
+				   void *buf, size_t size);
+extern int svec_eeprom_write_cached(struct fmc_device *fmc, uint32_t offset,
+				    const void *buf, size_t size);
+extern void svec_i2c_free_cache(struct svec_dev *svec);
+extern ssize_t svec_i2c_show_status(struct svec_dev *svec, char *buf,
+				    size_t size);
+extern ssize_t svec_eeprom_slot_read(struct svec_dev *svec, int slot,
+				     uint32_t offset, void *buf, size_t size);
+extern ssize_t svec_eeprom_slot_write(struct svec_dev *svec, int slot,
+				      uint32_t offset, const void *buf,
+				      size_t size);
 
 /* SVEC CSR offsets */
 #define FUN0ADER	0x7FF63
@@ -128,6 +306,17 @@ extern int svec_eeprom_write(struct fmc_device *fmc, uint32_t offset,
 #define RESET_CORE	0x80
 #define ENABLE_CORE	0x10
 
+/* Functions in svec-debugfs.c */
+extern void svec_debugfs_init(struct svec_dev *svec);
+extern void svec_debugfs_exit(struct svec_dev *svec);
+
+/* Functions in svec-cdev.c */
+extern int svec_cdev_init(struct svec_dev *svec);
+extern void svec_cdev_exit(struct svec_dev *svec);
+extern void svec_cdev_irq_exit(struct svec_dev *svec);
+extern void svec_cdev_set_window(struct svec_dev *svec,
+				 struct vme_mapping *map);
+
 /* Functions in svec-sysfs.c */
 extern int svec_create_sysfs_files(struct svec_dev *card);
 extern void svec_remove_sysfs_files(struct svec_dev *card);
@@ -145,11 +334,25 @@ int svec_validate_configuration(struct device *pdev, struct svec_config *cfg);
 int svec_load_golden(struct svec_dev *svec);
 
 /* VIC interrupt controller stuff */
-irqreturn_t svec_vic_irq_dispatch(struct svec_dev *svec);
-int svec_vic_irq_request(struct svec_dev *svec, struct fmc_device *fmc, unsigned long id, irq_handler_t handler);
+irqreturn_t svec_vic_irq_dispatch(struct svec_dev *svec, ktime_t stamp, u64 entry);
+ktime_t svec_vic_timestamp(struct svec_dev *svec, unsigned long id);
+uint32_t svec_vic_pending(struct svec_dev *svec);
+int svec_vic_irq_request(struct svec_dev *svec, struct fmc_device *fmc, unsigned long id, irq_handler_t handler, const char *name);
+int svec_vic_irq_map(struct svec_dev *svec, struct fmc_device *fmc, unsigned long id);
+int svec_vic_irq_lookup(struct svec_dev *svec, unsigned long id);
+int svec_vic_requested(struct svec_dev *svec);
+void svec_vic_irq_note(struct svec_dev *svec, unsigned int irq, irqreturn_t rv);
 int svec_vic_irq_free(struct svec_dev *svec, unsigned long id);
 void svec_vic_irq_ack(struct svec_dev *svec, unsigned long id);
 void svec_vic_cleanup(struct svec_dev *svec);
+void svec_vic_free_cache(struct svec_dev *svec);
+void svec_vic_exit(void);
+ssize_t svec_vic_show_vectors(struct svec_dev *svec, char *buf, size_t size);
+void svec_vic_show_stats(struct svec_dev *svec, struct seq_file *m);
+void svec_vic_reset_stats(struct svec_dev *svec);
+void svec_vic_set_retry(struct svec_dev *svec, unsigned int len);
+void svec_vic_tune_work(struct work_struct *work);
+int svec_vic_busy_poll(struct svec_dev *svec, int cpu);
 
 /* Generic IRQ routines */
 
@@ -158,6 +361,16 @@ int svec_irq_request(struct fmc_device *fmc, irq_handler_t handler, char *name,
 void svec_irq_ack(struct fmc_device *fmc);
 int svec_irq_free(struct fmc_device *fmc);
 void svec_irq_exit(struct svec_dev *svec);
+int svec_irq_find_mapping(struct fmc_device *fmc, unsigned long id);
+int svec_irq_find_card_mapping(struct svec_dev *svec, unsigned long id);
+void svec_irq_put_card_mapping(struct svec_dev *svec);
+ktime_t svec_irq_timestamp(struct fmc_device *fmc);
+ktime_t svec_irq_vector_timestamp(struct fmc_device *fmc, unsigned long id);
+void svec_irq_set_pending(struct fmc_device *fmc,
+			  int (*pending)(struct fmc_device *fmc));
+int svec_irq_vector(struct fmc_device *fmc);
+void svec_irq_show_vector(struct svec_dev *svec, struct seq_file *m);
+unsigned long svec_irq_count(struct svec_dev *svec);
 
 #endif /* __SVEC_H__ */
 
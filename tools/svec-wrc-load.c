@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2014 CERN (www.cern.ch)
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * svec-wrc-load: loads the White Rabbit PTP core firmware of SVEC cards,
+ * writing the CPU RAM through an mmap() of the VME register window
+ * (/dev/svec.<lun>). Cards are programmed in parallel, one thread each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define SVEC_SYSFS	"/sys/bus/vme/devices"
+
+/* the syscon of the WR core; its CPU RAM has no SDB ID of its own */
+#define WRC_SYSCON_VENDOR	0xce42ULL
+#define WRC_SYSCON_DEVICE	0xff07fc47
+#define WRC_RAM_OFFSET		0x20400		/* below the syscon */
+#define WRC_RST_HOLD		0x1deadbee
+#define WRC_RST_RELEASE		0x0deadbee
+#define WRC_RST_ACK		(1 << 28)
+#define WRC_RST_TIMEOUT_MS	1000
+
+#define VERIFY_BLOCK		1024		/* words */
+
+struct card {
+	int lun;
+	int slot;
+	uint64_t syscon;	/* absolute in the register window, ~0 if none */
+	pthread_t thread;
+	int started;
+	int err;
+	double ms;
+};
+
+static uint32_t *image;		/* big-endian words */
+static size_t image_words;
+static int verify;
+
+static char usage_string[] =
+	"usage: %s [-lac] [-u lun] [-s slot] [wrc-firmware.bin]\n"
+	"  -l       list the cards with a WR core\n"
+	"  -u lun   program the card with this lun\n"
+	"  -s slot  program the card in this slot\n"
+	"  -a       program all the cards with a WR core\n"
+	"  -c       verify the RAM by block readback (CRC)\n"
+	"The first card found is programmed if none is selected\n";
+
+static void usage(char *prog)
+{
+	fprintf(stderr, usage_string, prog);
+	exit(1);
+}
+
+static int sysfs_read(int lun, const char *attr, unsigned long *val)
+{
+	char path[128];
+	FILE *f;
+	int rv;
+
+	snprintf(path, sizeof(path), SVEC_SYSFS "/svec.%d/%s", lun, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	rv = fscanf(f, "%li", (long *)val);
+	fclose(f);
+	return rv == 1 ? 0 : -1;
+}
+
+/* Looks the syscon up in the driver's SDB device table */
+static uint64_t find_syscon(int lun)
+{
+	unsigned long long vendor, first, last;
+	unsigned int device;
+	char path[128], line[256];
+	uint64_t addr = ~0ULL;
+	FILE *f;
+
+	snprintf(path, sizeof(path), SVEC_SYSFS "/svec.%d/sdb_devices", lun);
+	f = fopen(path, "r");
+	if (!f)
+		return addr;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lli %i %lli %lli", &vendor, &device,
+			   &first, &last) != 4)
+			continue;
+		if (vendor == WRC_SYSCON_VENDOR && device == WRC_SYSCON_DEVICE) {
+			addr = first;
+			break;
+		}
+	}
+	fclose(f);
+	return addr;
+}
+
+/* Fills the table with every card of the crate, returns their number */
+static int scan_cards(struct card **cards)
+{
+	struct dirent *d;
+	struct card *c = NULL;
+	unsigned long slot;
+	int n = 0, lun;
+	DIR *dir;
+
+	dir = opendir(SVEC_SYSFS);
+	if (!dir) {
+		fprintf(stderr, "%s: %s\n", SVEC_SYSFS, strerror(errno));
+		exit(1);
+	}
+	while ((d = readdir(dir))) {
+		if (sscanf(d->d_name, "svec.%d", &lun) != 1)
+			continue;
+		if (sysfs_read(lun, "slot", &slot))
+			continue;
+		c = realloc(c, (n + 1) * sizeof(*c));
+		if (!c) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(&c[n], 0, sizeof(*c));
+		c[n].lun = lun;
+		c[n].slot = slot;
+		c[n].syscon = find_syscon(lun);
+		n++;
+	}
+	closedir(dir);
+	*cards = c;
+	return n;
+}
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = buf;
+	int i, j;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static int load_card(struct card *c)
+{
+	volatile uint32_t *win, *syscon, *ram;
+	uint32_t buf[VERIFY_BLOCK];
+	unsigned long size;
+	struct timespec t;
+	char name[32];
+	size_t i, n;
+	int fd, ms;
+
+	if (c->syscon == ~0ULL || c->syscon < WRC_RAM_OFFSET) {
+		fprintf(stderr, "svec.%d: no WR core in the gateware\n", c->lun);
+		return -1;
+	}
+	if (sysfs_read(c->lun, "vme_size", &size) ||
+	    c->syscon + 4 > size ||
+	    image_words * 4 > WRC_RAM_OFFSET) {
+		fprintf(stderr, "svec.%d: the image does not fit\n", c->lun);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "/dev/svec.%d", c->lun);
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	win = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (win == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", name, strerror(errno));
+		return -1;
+	}
+	syscon = win + c->syscon / 4;
+	ram = syscon - WRC_RAM_OFFSET / 4;
+
+	/* hold the CPU in reset */
+	*syscon = htonl(WRC_RST_HOLD);
+	for (ms = 0; !(ntohl(*syscon) & WRC_RST_ACK); ms++) {
+		if (ms == WRC_RST_TIMEOUT_MS) {
+			fprintf(stderr, "svec.%d: the CPU does not stop\n",
+				c->lun);
+			munmap((void *)win, size);
+			return -1;
+		}
+		t.tv_sec = 0;
+		t.tv_nsec = 1000 * 1000;
+		nanosleep(&t, NULL);
+	}
+
+	for (i = 0; i < image_words; i++)
+		ram[i] = image[i];
+
+	for (i = 0; verify && i < image_words; i += n) {
+		n = image_words - i < VERIFY_BLOCK ? image_words - i : VERIFY_BLOCK;
+		memcpy(buf, (void *)(ram + i), n * 4);
+		if (crc32(0, buf, n * 4) == crc32(0, image + i, n * 4))
+			continue;
+		fprintf(stderr, "svec.%d: verify failed in words 0x%zx-0x%zx\n",
+			c->lun, i, i + n - 1);
+		munmap((void *)win, size);
+		return -1;
+	}
+
+	/* start the CPU */
+	*syscon = htonl(WRC_RST_RELEASE);
+	munmap((void *)win, size);
+	return 0;
+}
+
+static void *load_thread(void *arg)
+{
+	struct card *c = arg;
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c->err = load_card(c);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c->ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+	return NULL;
+}
+
+static void read_image(char *filename)
+{
+	struct stat st;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f || fstat(fileno(f), &st)) {
+		fprintf(stderr, "Can't open: '%s'\n", filename);
+		exit(1);
+	}
+	image_words = (st.st_size + 3) / 4;
+	image = calloc(image_words ? image_words : 1, 4);
+	if (!image || fread(image, 1, st.st_size, f) != (size_t)st.st_size) {
+		fprintf(stderr, "Can't read: '%s'\n", filename);
+		exit(1);
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	struct card *cards;
+	int lun = -1, slot = -1, all = 0, list = 0;
+	int i, n, c, skip, todo = 0, err = 0;
+
+	while ((c = getopt(argc, argv, "lacu:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			list = 1;
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'c':
+			verify = 1;
+			break;
+		case 'u':
+			lun = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			slot = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	n = scan_cards(&cards);
+
+	if (list) {
+		for (i = 0; i < n; i++)
+			if (cards[i].syscon != ~0ULL)
+				printf("Found WR Core in SVEC @ lun %d slot %d\n",
+				       cards[i].lun, cards[i].slot);
+		return 0;
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+	read_image(argv[optind]);
+
+	for (i = 0; i < n; i++) {
+		struct card *cd = &cards[i];
+
+		if (all)
+			skip = cd->syscon == ~0ULL;
+		else if (lun < 0 && slot < 0)
+			skip = i > 0;	/* as svec-wrc-loader: the first card */
+		else
+			skip = cd->lun != lun && cd->slot != slot;
+		if (skip)
+			continue;
+		printf("Loading WR Core firmware for SVEC @ lun %d slot %d\n",
+		       cd->lun, cd->slot);
+		if (pthread_create(&cd->thread, NULL, load_thread, cd)) {
+			fprintf(stderr, "svec.%d: can't start a thread\n",
+				cd->lun);
+			err = 1;
+			break;
+		}
+		cd->started = 1;
+		todo++;
+	}
+	if (!todo && !err) {
+		fprintf(stderr, "No SVEC with a WR core selected\n");
+		return 1;
+	}
+
+	/* even after a failure: the started loads must not be cut short */
+
+	for (i = 0; i < n; i++) {
+		if (!cards[i].started)
+			continue;
+		pthread_join(cards[i].thread, NULL);
+		printf("svec.%d (slot %d): %s in %.1f ms\n", cards[i].lun,
+		       cards[i].slot, cards[i].err ? "failed" : "loaded",
+		       cards[i].ms);
+		if (cards[i].err)
+			err = 1;
+	}
+	return err;
+}